@@ -0,0 +1,363 @@
+/*
+ * Copyright (C) 2014 Prefeitura de Mogi das Cruzes, SP, Brazil
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file ephyr-latency-bench.c
+ *
+ * End-to-end input latency of a nested server.
+ *
+ * Runs on a host display (best an otherwise idle Xvfb, see
+ * run-latency-bench.sh), starts the nested server inside a window of its
+ * own with -parent, and puts a client on the nested display that repaints
+ * its window on every key press.  Each sample is a key press injected on
+ * the host with XTEST, timed until the nested client gets it ("input")
+ * and until the repaint reaches the host window, as seen by a DAMAGE
+ * object there ("paint").  All the times are taken here, on one clock.
+ *
+ * Usage: ephyr-latency-bench [-n samples] [-s server] [-d display]
+ *                            [-- server arguments]
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <xcb/xcb.h>
+#include <xcb/xtest.h>
+#include <xcb/damage.h>
+
+#define BENCH_WIDTH 640
+#define BENCH_HEIGHT 480
+
+/** Longest wait for one sample to go through, in microseconds */
+#define BENCH_TIMEOUT 1000000
+
+/** Quiet time between samples, in microseconds */
+#define BENCH_GAP 20000
+
+static int64_t
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static xcb_connection_t *
+connect_retry(const char *display, int *screen)
+{
+    int tries;
+
+    for (tries = 0; tries < 100; tries++) {
+        xcb_connection_t *conn = xcb_connect(display, screen);
+
+        if (!xcb_connection_has_error(conn))
+            return conn;
+        xcb_disconnect(conn);
+        usleep(100000);
+    }
+
+    fprintf(stderr, "can't connect to %s\n", display ? display : "$DISPLAY");
+    exit(1);
+}
+
+static xcb_screen_t *
+get_screen(xcb_connection_t *conn, int screen)
+{
+    xcb_screen_iterator_t it = xcb_setup_roots_iterator(xcb_get_setup(conn));
+
+    while (screen-- > 0)
+        xcb_screen_next(&it);
+    return it.data;
+}
+
+/**
+ * Wait until either connection has an event, or until @deadline.  Returns
+ * the event, with *@from set to the connection it came from, or NULL.
+ */
+static xcb_generic_event_t *
+wait_event(xcb_connection_t *conns[2], int *from, int64_t deadline)
+{
+    for (;;) {
+        struct pollfd fds[2];
+        int i, timeout;
+
+        for (i = 0; i < 2; i++) {
+            xcb_generic_event_t *ev = xcb_poll_for_event(conns[i]);
+
+            if (ev) {
+                *from = i;
+                return ev;
+            }
+            if (xcb_connection_has_error(conns[i])) {
+                fprintf(stderr, "lost the %s connection\n",
+                        i ? "nested" : "host");
+                exit(1);
+            }
+            fds[i].fd = xcb_get_file_descriptor(conns[i]);
+            fds[i].events = POLLIN;
+        }
+
+        timeout = (int) ((deadline - now_us() + 999) / 1000);
+        if (timeout <= 0)
+            return NULL;
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+    }
+}
+
+/* Handle the events that turned up between samples */
+static void
+drain(xcb_connection_t *conns[2], xcb_damage_damage_t damage)
+{
+    xcb_generic_event_t *ev;
+    int from;
+
+    while ((ev = wait_event(conns, &from, now_us() + BENCH_GAP)))
+        free(ev);
+    xcb_damage_subtract(conns[0], damage, XCB_NONE, XCB_NONE);
+    xcb_flush(conns[0]);
+}
+
+static int
+cmp_us(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+report(const char *what, int64_t *samples, int n)
+{
+    if (!n) {
+        printf("%-6s no samples\n", what);
+        return;
+    }
+
+    qsort(samples, n, sizeof(*samples), cmp_us);
+    printf("%-6s p50 %7.2f ms   p99 %7.2f ms   max %7.2f ms\n", what,
+           samples[n / 2] / 1000.0,
+           samples[(n * 99 + 99) / 100 - 1] / 1000.0,
+           samples[n - 1] / 1000.0);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n samples] [-s server] [-d display] "
+            "[-- server arguments]\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *server = "Xephyr", *display = ":77";
+    int samples = 500, opt, i, n_input = 0, n_paint = 0, lost = 0;
+    xcb_connection_t *conns[2];
+    xcb_screen_t *hscreen, *nscreen;
+    xcb_window_t hwin, nwin;
+    xcb_gcontext_t gc;
+    xcb_damage_damage_t damage;
+    const xcb_query_extension_reply_t *ext;
+    xcb_test_get_version_reply_t *xtest;
+    xcb_damage_query_version_reply_t *damage_version;
+    uint8_t damage_notify;
+    xcb_keycode_t keycode;
+    int64_t *input_us, *paint_us;
+    char wid[16];
+    char **server_argv;
+    int hscr, nscr;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "n:s:d:")) != -1) {
+        switch (opt) {
+        case 'n':
+            samples = atoi(optarg);
+            break;
+        case 's':
+            server = optarg;
+            break;
+        case 'd':
+            display = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (samples <= 0)
+        usage(argv[0]);
+
+    input_us = calloc(samples, sizeof(*input_us));
+    paint_us = calloc(samples, sizeof(*paint_us));
+    server_argv = calloc(argc - optind + 5, sizeof(*server_argv));
+    if (!input_us || !paint_us || !server_argv)
+        return 1;
+
+    /* The host: a window for the nested server, watched by DAMAGE */
+    conns[0] = connect_retry(NULL, &hscr);
+    hscreen = get_screen(conns[0], hscr);
+
+    xtest = xcb_test_get_version_reply(conns[0],
+        xcb_test_get_version(conns[0], 2, 2), NULL);
+    damage_version = xcb_damage_query_version_reply(conns[0],
+        xcb_damage_query_version(conns[0], 1, 1), NULL);
+    ext = xcb_get_extension_data(conns[0], &xcb_damage_id);
+    if (!xtest || !damage_version || !ext || !ext->present) {
+        fprintf(stderr, "the host needs XTEST and DAMAGE\n");
+        return 1;
+    }
+    damage_notify = ext->first_event + XCB_DAMAGE_NOTIFY;
+    free(xtest);
+    free(damage_version);
+
+    hwin = xcb_generate_id(conns[0]);
+    xcb_create_window(conns[0], XCB_COPY_FROM_PARENT, hwin, hscreen->root,
+                      0, 0, BENCH_WIDTH, BENCH_HEIGHT, 0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT,
+                      0, NULL);
+    xcb_map_window(conns[0], hwin);
+
+    /* Keys go to whatever is under the pointer: the nested server */
+    xcb_set_input_focus(conns[0], XCB_INPUT_FOCUS_POINTER_ROOT,
+                        XCB_INPUT_FOCUS_POINTER_ROOT, XCB_CURRENT_TIME);
+    xcb_warp_pointer(conns[0], XCB_NONE, hwin, 0, 0, 0, 0,
+                     BENCH_WIDTH / 2, BENCH_HEIGHT / 2);
+    xcb_flush(conns[0]);
+
+    snprintf(wid, sizeof(wid), "0x%x", hwin);
+    server_argv[0] = (char *) server;
+    server_argv[1] = (char *) display;
+    server_argv[2] = "-parent";
+    server_argv[3] = wid;
+    for (i = optind; i < argc; i++)
+        server_argv[i - optind + 4] = argv[i];
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        execvp(server, server_argv);
+        perror(server);
+        _exit(127);
+    }
+
+    /* The nested client: a window over the whole screen, repainted in
+     * another colour on every key press.
+     */
+    conns[1] = connect_retry(display, &nscr);
+    nscreen = get_screen(conns[1], nscr);
+
+    nwin = xcb_generate_id(conns[1]);
+    xcb_create_window(conns[1], XCB_COPY_FROM_PARENT, nwin, nscreen->root,
+                      0, 0, nscreen->width_in_pixels,
+                      nscreen->height_in_pixels, 0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT,
+                      XCB_CW_EVENT_MASK,
+                      (uint32_t[]) { XCB_EVENT_MASK_KEY_PRESS |
+                                     XCB_EVENT_MASK_EXPOSURE });
+    gc = xcb_generate_id(conns[1]);
+    xcb_create_gc(conns[1], gc, nwin, 0, NULL);
+    xcb_map_window(conns[1], nwin);
+    xcb_flush(conns[1]);
+
+    damage = xcb_generate_id(conns[0]);
+    xcb_damage_create(conns[0], damage, hwin,
+                      XCB_DAMAGE_REPORT_LEVEL_NON_EMPTY);
+    xcb_flush(conns[0]);
+
+    keycode = xcb_get_setup(conns[0])->min_keycode;
+    if (keycode < 38 && xcb_get_setup(conns[0])->max_keycode >= 38)
+        keycode = 38;
+
+    /* let mapping and the first frames settle */
+    usleep(500000);
+    drain(conns, damage);
+
+    for (i = 0; i < samples; i++) {
+        int64_t start, input = -1, paint = -1;
+        xcb_generic_event_t *ev;
+        int from;
+
+        start = now_us();
+        xcb_test_fake_input(conns[0], XCB_KEY_PRESS, keycode,
+                            XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+        xcb_test_fake_input(conns[0], XCB_KEY_RELEASE, keycode,
+                            XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+        xcb_flush(conns[0]);
+
+        while (paint < 0 &&
+               (ev = wait_event(conns, &from, start + BENCH_TIMEOUT))) {
+            uint8_t type = ev->response_type & 0x7f;
+
+            if (from == 1 && type == XCB_KEY_PRESS && input < 0) {
+                xcb_rectangle_t all = {
+                    0, 0, nscreen->width_in_pixels, nscreen->height_in_pixels
+                };
+                uint32_t pixel = (i & 1) ? nscreen->black_pixel :
+                                           nscreen->white_pixel;
+
+                input = now_us() - start;
+                xcb_change_gc(conns[1], gc, XCB_GC_FOREGROUND, &pixel);
+                xcb_poly_fill_rectangle(conns[1], nwin, gc, 1, &all);
+                xcb_flush(conns[1]);
+            }
+            else if (from == 0 && type == damage_notify && input >= 0) {
+                paint = now_us() - start;
+            }
+            free(ev);
+        }
+
+        if (input >= 0)
+            input_us[n_input++] = input;
+        if (paint >= 0)
+            paint_us[n_paint++] = paint;
+        else
+            lost++;
+
+        drain(conns, damage);
+    }
+
+    printf("%d samples, %d without a paint\n", samples, lost);
+    report("input", input_us, n_input);
+    report("paint", paint_us, n_paint);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    xcb_disconnect(conns[1]);
+    xcb_disconnect(conns[0]);
+
+    return lost == samples;
+}
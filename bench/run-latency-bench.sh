@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Build ephyr-latency-bench and run it against a private Xvfb host.
+#
+# Usage: run-latency-bench.sh [ephyr-latency-bench options] [-- server args]
+#
+# HOST_DISPLAY picks the Xvfb display (default :90), CC the compiler.
+# Needs Xvfb, Xephyr (or -s another nested server) and the xcb, xcb-xtest
+# and xcb-damage development files.
+
+set -e
+
+dir=$(dirname "$0")
+host=${HOST_DISPLAY:-:90}
+tmp=$(mktemp -d)
+xvfb=
+
+cleanup() {
+    [ -n "$xvfb" ] && kill "$xvfb" 2>/dev/null
+    rm -rf "$tmp"
+}
+trap cleanup EXIT INT TERM
+
+${CC:-cc} -O2 -Wall -o "$tmp/ephyr-latency-bench" \
+    "$dir/ephyr-latency-bench.c" \
+    $(pkg-config --cflags --libs xcb xcb-xtest xcb-damage)
+
+Xvfb "$host" -screen 0 1024x768x24 -nolisten tcp >"$tmp/Xvfb.log" 2>&1 &
+xvfb=$!
+
+# the harness retries until Xvfb accepts connections
+DISPLAY=$host "$tmp/ephyr-latency-bench" "$@"
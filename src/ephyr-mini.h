@@ -27,20 +27,41 @@
 #define _EPHYR_H_
 
 #include <xcb/xcb_image.h>
+#include "ephyr_convert.h"
+
+/* Most host images (SHM segments) a screen can paint through */
+#define EPHYR_MAX_HOST_IMAGES 3
+
+/* Longest the host may take to complete a SHM put, in milliseconds,
+ * before the segment is written to again anyway */
+#define EPHYR_SHM_PUT_TIMEOUT 100
+
+typedef struct _ephyrHostImage {
+    xcb_image_t *ximg;
+    xcb_shm_segment_info_t shminfo; /* shmaddr is NULL without SHM */
+    int puts_pending;               /* SHM puts not yet completed by host */
+    CARD32 put_time;                /* when the last of them was sent */
+    size_t shm_size;                /* memfd segment: bytes mapped, or 0 */
+    int shm_fd;                     /* memfd backing shmaddr, if shm_size */
+} EphyrHostImage;
 
 typedef struct _ephyrScrPriv {
     /* Host X window info */
     xcb_window_t win;
     xcb_window_t win_pre_existing; /* Set via -parent option like xnest */
     xcb_window_t peer_win;         /* Used for GL; should be at most one */
-    xcb_image_t *ximg;
+    EphyrHostImage images[EPHYR_MAX_HOST_IMAGES];
+    int n_images;
+    int cur_image;                 /* image the last paint went through */
     Bool win_explicit_position;
     int win_x, win_y;
     int win_width, win_height;
     int server_depth;
     const char *output;            /* Set via -output option */
-    unsigned char *fb_data;        /* only used when host bpp != server bpp */
-    xcb_shm_segment_info_t shminfo;
+    unsigned char *fb_data;        /* only used when host bpp != server bpp
+                                    * or with several host images */
+    int fb_stride;
+    EphyrConvert *convert;         /* fb_data to host image */
 
     KdScreenInfo *screen;
     int mynum;                     /* Screen number */
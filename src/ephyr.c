@@ -27,7 +27,13 @@
 #include <kdrive-config.h>
 #endif
 
-#include <xcb/xcb_keysyms.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <xcb/shm.h>
 #include <X11/keysym.h>
 
 #include "ephyr.h"
@@ -60,6 +66,16 @@ Bool ephyrNoDRI = FALSE;
 Bool ephyrNoXV = FALSE;
 
 static int mouseState = 0;
+
+/* While grabbed, pointer motion comes as XI2 raw deltas; the part not
+ * yet enqueued, fractions included, is gathered here. */
+static Bool ephyrRawMotion = FALSE;
+static double ephyrRawDx, ephyrRawDy;
+static xcb_timestamp_t ephyrRawTime;    /* of the oldest delta gathered */
+
+/* Host keycodes pressed and not released yet, one bit each */
+static CARD8 ephyrKeysDown[MAP_LENGTH / 8];
+
 static Rotation ephyrRandr = RR_Rotate_0;
 
 typedef struct _EphyrInputPrivate {
@@ -68,6 +84,7 @@ typedef struct _EphyrInputPrivate {
 
 Bool EphyrWantGrayScale = 0;
 Bool EphyrWantResize = 0;
+int ephyrRedisplayInterval = 1000 / EPHYR_DEFAULT_FPS; /* ms, 0 for no limit */
 
 Bool
 host_has_extension(xcb_extension_t *extension)
@@ -79,10 +96,20 @@ host_has_extension(xcb_extension_t *extension)
     return rep && rep->present;
 }
 
+/* SIGUSR2 asks for the input latency histograms, see ephyrNoteInput() */
+static volatile sig_atomic_t ephyrLatencyDumpWanted = 0;
+
+static void
+ephyrLatencySignal(int signum)
+{
+    ephyrLatencyDumpWanted = 1;
+}
+
 Bool
 ephyrInitialize(KdCardInfo * card, EphyrPriv * priv)
 {
     OsSignal(SIGUSR1, hostx_handle_signal);
+    OsSignal(SIGUSR2, ephyrLatencySignal);
 
     priv->base = 0;
     priv->bytes_per_line = 0;
@@ -128,7 +155,8 @@ ephyrScreenInitialize(KdScreenInfo *screen)
 
     if (screen->fb.depth && screen->fb.depth != hostx_get_depth()) {
         if (screen->fb.depth < hostx_get_depth()
-            && (screen->fb.depth == 24 || screen->fb.depth == 16
+            && (screen->fb.depth == 30 || screen->fb.depth == 24
+                || screen->fb.depth == 16 || screen->fb.depth == 15
                 || screen->fb.depth == 8)) {
             scrpriv->server_depth = screen->fb.depth;
         }
@@ -303,20 +331,246 @@ ephyrUnmapFramebuffer(KdScreenInfo * screen)
     return TRUE;
 }
 
+/*
+ * Map a damaged box of the rotated screen onto the framebuffer the shadow
+ * layer rotates into, which is the host image.  The box is grown by a
+ * pixel on every side, clipped to the framebuffer, so that it covers the
+ * rotated pixels whatever the rounding of the rotation code.
+ */
+static void
+ephyrRotateBox(ScreenPtr pScreen, Rotation randr, BoxPtr box,
+               int fb_width, int fb_height)
+{
+    int sw = pScreen->width, sh = pScreen->height;
+    BoxRec b = *box;
+
+    switch (randr & RR_Rotate_All) {
+    case RR_Rotate_90:
+        box->x1 = b.y1;
+        box->x2 = b.y2;
+        box->y1 = sw - b.x2;
+        box->y2 = sw - b.x1;
+        break;
+    case RR_Rotate_180:
+        box->x1 = sw - b.x2;
+        box->x2 = sw - b.x1;
+        box->y1 = sh - b.y2;
+        box->y2 = sh - b.y1;
+        break;
+    case RR_Rotate_270:
+        box->x1 = sh - b.y2;
+        box->x2 = sh - b.y1;
+        box->y1 = b.x1;
+        box->y2 = b.x2;
+        break;
+    }
+
+    box->x1 = max(box->x1 - 1, 0);
+    box->y1 = max(box->y1 - 1, 0);
+    box->x2 = min(box->x2 + 1, fb_width);
+    box->y2 = min(box->y2 + 1, fb_height);
+}
+
+/*
+ * Input latency accounting.  Each screen keeps two histograms: from the
+ * host event's timestamp to it being enqueued here, and from then to the
+ * next paint of the screen, taken as the one carrying whatever damage
+ * the input caused.  The host's timestamps only compare with ours when
+ * both servers share a clock, that is run on the same machine.  Send
+ * SIGUSR2 to have the histograms written to the log.
+ */
+static void
+ephyrLatencyAdd(EphyrLatency *lat, CARD32 ms)
+{
+    int bucket = 0;
+
+    while (ms && bucket < EPHYR_LATENCY_BUCKETS - 1) {
+        ms >>= 1;
+        bucket++;
+    }
+    lat->count[bucket]++;
+}
+
+/**
+ * Account for input just enqueued for @screen, stamped @time by the host.
+ * May run from the SIGIO handler.
+ */
+static void
+ephyrNoteInput(KdScreenInfo *screen, xcb_timestamp_t time)
+{
+    EphyrScrPriv *scrpriv = screen ? screen->driver : NULL;
+    CARD32 now = GetTimeInMillis();
+
+    if (!scrpriv)
+        return;
+
+    /* a host on another clock gives nonsense, leave that out */
+    if (now - time < 60000)
+        ephyrLatencyAdd(&scrpriv->host_latency, now - time);
+
+    if (!scrpriv->input_pending) {
+        scrpriv->input_time = now;
+        scrpriv->input_pending = TRUE;
+    }
+}
+
+static void
+ephyrNotePaint(KdScreenInfo *screen)
+{
+    EphyrScrPriv *scrpriv = screen->driver;
+
+    if (!scrpriv->input_pending)
+        return;
+
+    OsBlockSIGIO();
+    ephyrLatencyAdd(&scrpriv->paint_latency,
+                    GetTimeInMillis() - scrpriv->input_time);
+    scrpriv->input_pending = FALSE;
+    OsReleaseSIGIO();
+}
+
+static void
+ephyrLatencyPrint(int screen, const char *what, const EphyrLatency *lat)
+{
+    CARD32 total = 0, seen = 0;
+    int i, p50 = -1, p99 = -1;
+
+    for (i = 0; i < EPHYR_LATENCY_BUCKETS; i++)
+        total += lat->count[i];
+
+    ErrorF("Xephyr screen %d, %s latency, %u events:", screen, what, total);
+    for (i = 0; i < EPHYR_LATENCY_BUCKETS; i++) {
+        seen += lat->count[i];
+        if (p50 < 0 && seen * 2 >= total)
+            p50 = i;
+        if (p99 < 0 && (uint64_t) seen * 100 >= (uint64_t) total * 99)
+            p99 = i;
+        if (lat->count[i])
+            ErrorF(" %s%dms:%u", i < EPHYR_LATENCY_BUCKETS - 1 ? "<" : ">=",
+                   1 << (i < EPHYR_LATENCY_BUCKETS - 1 ? i : i - 1),
+                   lat->count[i]);
+    }
+    if (total)
+        ErrorF(" (p50 <%dms, p99 <%dms)", 1 << p50, 1 << p99);
+    ErrorF("\n");
+}
+
+static void
+ephyrLatencyDump(void)
+{
+    int i;
+
+    for (i = 0; i < screenInfo.numScreens; i++) {
+        KdScreenPriv(screenInfo.screens[i]);
+        EphyrScrPriv *scrpriv = pScreenPriv->screen->driver;
+
+        ephyrLatencyPrint(i, "host to queue", &scrpriv->host_latency);
+        ephyrLatencyPrint(i, "queue to paint", &scrpriv->paint_latency);
+    }
+}
+
+static int
+ephyrScheduleRedisplay(ScreenPtr pScreen);
+
+/*
+ * Rotated screens keep the framebuffer boxes shadow has updated in
+ * shadow_damage, as shadow empties its own damage once ephyrShadowUpdate()
+ * returns.  They are painted on the same schedule as the damage of
+ * unrotated screens.
+ */
+static void
+ephyrAddShadowDamage(KdScreenInfo *screen, RegionPtr region)
+{
+    EphyrScrPriv *scrpriv = screen->driver;
+
+    RegionUnion(&scrpriv->shadow_damage, &scrpriv->shadow_damage, region);
+    ephyrScheduleRedisplay(screen->pScreen);
+}
+
+/*
+ * Have the whole framebuffer painted again, on the redisplay schedule,
+ * rather than put right away behind a frame the host may still be reading.
+ */
+static void
+ephyrDamageHostWindow(KdScreenInfo *screen)
+{
+    EphyrScrPriv *scrpriv = screen->driver;
+    BoxRec box = { 0, 0, screen->width, screen->height };
+    RegionRec region;
+
+    if (!scrpriv->redisplay)
+        return;
+
+    RegionInit(&region, &box, 1);
+    if (scrpriv->pDamage) {
+        DamageReportDamage(scrpriv->pDamage, &region);
+        ephyrScheduleRedisplay(screen->pScreen);
+    }
+    else
+        ephyrAddShadowDamage(screen, &region);
+    RegionUninit(&region);
+}
+
 void
 ephyrShadowUpdate(ScreenPtr pScreen, shadowBufPtr pBuf)
 {
     KdScreenPriv(pScreen);
     KdScreenInfo *screen = pScreenPriv->screen;
+    RegionPtr damage = DamageRegion(pBuf->pDamage);
+    int nbox = RegionNumRects(damage);
+    BoxPtr pbox = RegionRects(damage);
+    RegionRec region;
+    BoxPtr boxes;
+    int i;
 
-    EPHYR_LOG("slow paint");
-
-    /* FIXME: Slow Rotated/Reflected updates could be much
-     * much faster efficiently updating via tranforming 
-     * pBuf->pDamage  regions     
-     */
+    /* only damaged boxes get rotated */
     shadowUpdateRotatePacked(pScreen, pBuf);
-    hostx_paint_rect(screen, 0, 0, 0, 0, screen->width, screen->height);
+
+    /* Reflections are rare enough to just repaint everything */
+    boxes = (pBuf->randr & RR_Reflect_All) ? NULL :
+        malloc(nbox * sizeof(BoxRec));
+    if (!boxes) {
+        BoxRec all = { 0, 0, screen->width, screen->height };
+
+        RegionInit(&region, &all, 1);
+        ephyrAddShadowDamage(screen, &region);
+        RegionUninit(&region);
+        return;
+    }
+
+    for (i = 0; i < nbox; i++) {
+        boxes[i] = pbox[i];
+        ephyrRotateBox(pScreen, pBuf->randr, &boxes[i],
+                       screen->width, screen->height);
+    }
+
+    /* the rotated boxes overlap and are out of band order: let
+     * RegionValidate() sort them out */
+    RegionInitBoxes(&region, boxes, nbox);
+    free(boxes);
+    if (nbox > 1) {
+        Bool overlap;
+
+        RegionValidate(&region, &overlap);
+    }
+
+    ephyrAddShadowDamage(screen, &region);
+    RegionUninit(&region);
+}
+
+/*
+ * The damage waiting to be painted, in framebuffer coordinates: what the
+ * screen pixmap's damage tracked, or for rotated screens, what shadow
+ * updated.  NULL until the screen has its resources.
+ */
+static RegionPtr
+ephyrRedisplayRegion(EphyrScrPriv *scrpriv)
+{
+    if (!scrpriv || !scrpriv->redisplay)
+        return NULL;
+    if (scrpriv->pDamage)
+        return DamageRegion(scrpriv->pDamage);
+    return &scrpriv->shadow_damage;
 }
 
 static void
@@ -325,41 +579,81 @@ ephyrInternalDamageRedisplay(ScreenPtr pScreen)
     KdScreenPriv(pScreen);
     KdScreenInfo *screen = pScreenPriv->screen;
     EphyrScrPriv *scrpriv = screen->driver;
-    RegionPtr pRegion;
+    RegionPtr pRegion = ephyrRedisplayRegion(scrpriv);
 
-    if (!scrpriv || !scrpriv->pDamage)
+    if (!pRegion)
         return;
 
-    pRegion = DamageRegion(scrpriv->pDamage);
+    /* The host hasn't finished with our last frame yet: let the damage
+     * accumulate and paint it all once the put completes.
+     */
+    if (hostx_paint_pending(screen))
+        return;
 
-    if (RegionNotEmpty(pRegion)) {
-        int nbox;
-        BoxPtr pbox;
+    if (RegionNotEmpty(pRegion) && hostx_paint_region(screen, pRegion)) {
+        if (scrpriv->pDamage)
+            DamageEmpty(scrpriv->pDamage);
+        else
+            RegionEmpty(pRegion);
+        ephyrNotePaint(screen);
+    }
+}
 
-        if (ephyr_glamor) {
-            ephyr_glamor_damage_redisplay(scrpriv->glamor, pRegion);
-        } else {
-            nbox = RegionNumRects(pRegion);
-            pbox = RegionRects(pRegion);
+/*
+ * Paint the accumulated damage if a frame is due, so that a client
+ * repainting nonstop gets at most one frame per ephyrRedisplayInterval.
+ * Returns how many milliseconds to wait for the next frame, or -1 when
+ * there is nothing to wait for: no damage, or a put the host hasn't
+ * completed yet, whose completion event (or failing that, the timeout
+ * the block handler sets) will wake us up.
+ */
+static int
+ephyrScheduleRedisplay(ScreenPtr pScreen)
+{
+    KdScreenPriv(pScreen);
+    KdScreenInfo *screen = pScreenPriv->screen;
+    EphyrScrPriv *scrpriv = screen->driver;
+    RegionPtr pRegion = ephyrRedisplayRegion(scrpriv);
 
-            while (nbox--) {
-                hostx_paint_rect(screen,
-                                 pbox->x1, pbox->y1,
-                                 pbox->x1, pbox->y1,
-                                 pbox->x2 - pbox->x1, pbox->y2 - pbox->y1);
-                pbox++;
-            }
-        }
-        DamageEmpty(scrpriv->pDamage);
+    if (!pRegion || !RegionNotEmpty(pRegion))
+        return -1;
+
+    if (ephyrRedisplayInterval) {
+        CARD32 now = GetTimeInMillis();
+        int delay = (int) (scrpriv->next_redisplay - now);
+
+        if (delay > 0)
+            return delay;
+        if (hostx_paint_pending(screen))
+            return -1;
+
+        /* ticks missed while idle aren't made up for */
+        scrpriv->next_redisplay = now + ephyrRedisplayInterval;
     }
+
+    ephyrInternalDamageRedisplay(pScreen);
+    return -1;
 }
 
 static void
 ephyrInternalDamageBlockHandler(void *data, OSTimePtr pTimeout, void *pRead)
 {
     ScreenPtr pScreen = (ScreenPtr) data;
+    int delay = ephyrScheduleRedisplay(pScreen);
 
-    ephyrInternalDamageRedisplay(pScreen);
+    /* a swap or put completion the host never sends must not hold the
+     * damage back for good: look again once the wait for it has timed out */
+    if (delay < 0) {
+        KdScreenPriv(pScreen);
+
+        if (hostx_paint_pending(pScreenPriv->screen))
+            delay = ephyr_glamor ? EPHYR_GLAMOR_SWAP_TIMEOUT :
+                EPHYR_SHM_PUT_TIMEOUT;
+    }
+
+    /* with no damage we don't ask to be woken up at all */
+    if (delay >= 0)
+        AdjustWaitForDelay(pTimeout, delay);
 }
 
 static void
@@ -368,6 +662,11 @@ ephyrInternalDamageWakeupHandler(void *data, int i, void *LastSelectMask)
     /* FIXME: Not needed ? */
 }
 
+/*
+ * Set up painting the host window on the redisplay schedule.  Unrotated
+ * screens track the damage to their pixmap; rotated ones get theirs from
+ * ephyrShadowUpdate(), once KdShadowSet() is done.
+ */
 Bool
 ephyrSetInternalDamage(ScreenPtr pScreen)
 {
@@ -376,15 +675,21 @@ ephyrSetInternalDamage(ScreenPtr pScreen)
     EphyrScrPriv *scrpriv = screen->driver;
     PixmapPtr pPixmap = NULL;
 
-    scrpriv->pDamage = DamageCreate((DamageReportFunc) 0,
-                                    (DamageDestroyFunc) 0,
-                                    DamageReportNone, TRUE, pScreen, pScreen);
-
     if (!RegisterBlockAndWakeupHandlers(ephyrInternalDamageBlockHandler,
                                         ephyrInternalDamageWakeupHandler,
                                         (void *) pScreen))
         return FALSE;
 
+    RegionNull(&scrpriv->shadow_damage);
+    scrpriv->redisplay = TRUE;
+
+    if (scrpriv->shadow)
+        return TRUE;
+
+    scrpriv->pDamage = DamageCreate((DamageReportFunc) 0,
+                                    (DamageDestroyFunc) 0,
+                                    DamageReportNone, TRUE, pScreen, pScreen);
+
     pPixmap = (*pScreen->GetScreenPixmap) (pScreen);
 
     DamageRegister(&pPixmap->drawable, scrpriv->pDamage);
@@ -399,7 +704,15 @@ ephyrUnsetInternalDamage(ScreenPtr pScreen)
     KdScreenInfo *screen = pScreenPriv->screen;
     EphyrScrPriv *scrpriv = screen->driver;
 
-    DamageDestroy(scrpriv->pDamage);
+    if (!scrpriv->redisplay)
+        return;
+
+    if (scrpriv->pDamage) {
+        DamageDestroy(scrpriv->pDamage);
+        scrpriv->pDamage = NULL;
+    }
+    RegionUninit(&scrpriv->shadow_damage);
+    scrpriv->redisplay = FALSE;
 
     RemoveBlockAndWakeupHandlers(ephyrInternalDamageBlockHandler,
                                  ephyrInternalDamageWakeupHandler,
@@ -525,22 +838,19 @@ ephyrRandRSetConfig(ScreenPtr pScreen,
 
     if (oldshadow)
         KdShadowUnset(screen->pScreen);
-    else
-        ephyrUnsetInternalDamage(screen->pScreen);
+    ephyrUnsetInternalDamage(screen->pScreen);
 
     if (scrpriv->shadow) {
         if (!KdShadowSet(screen->pScreen,
                          scrpriv->randr, ephyrShadowUpdate, ephyrWindowLinear))
             goto bail4;
     }
-    else {
-        /* Without shadow fb ( non rotated ) we need 
-         * to use damage to efficiently update display
-         * via signal regions what to copy from 'fb'.
-         */
-        if (!ephyrSetInternalDamage(screen->pScreen))
-            goto bail4;
-    }
+
+    /* Paint from damage on the redisplay schedule; with shadow fb
+     * ( rotated ) ephyrShadowUpdate() tells what to copy from 'fb'.
+     */
+    if (!ephyrSetInternalDamage(screen->pScreen))
+        goto bail4;
 
     ephyrSetScreenSizes(screen->pScreen);
 
@@ -712,17 +1022,20 @@ ephyrCreateResources(ScreenPtr pScreen)
     EPHYR_LOG("mark pScreen=%p mynum=%d shadow=%d",
               pScreen, pScreen->myNum, scrpriv->shadow);
 
-    if (scrpriv->shadow)
-        return KdShadowSet(pScreen,
-                           scrpriv->randr,
-                           ephyrShadowUpdate, ephyrWindowLinear);
+    if (scrpriv->shadow) {
+        if (!KdShadowSet(pScreen,
+                         scrpriv->randr,
+                         ephyrShadowUpdate, ephyrWindowLinear))
+            return FALSE;
+    }
     else {
 #ifdef GLAMOR
         if (ephyr_glamor)
             ephyr_glamor_create_screen_resources(pScreen);
 #endif
-        return ephyrSetInternalDamage(pScreen);
     }
+
+    return ephyrSetInternalDamage(pScreen);
 }
 
 void
@@ -760,6 +1073,7 @@ ephyrScreenFini(KdScreenInfo * screen)
     if (scrpriv->shadow) {
         KdShadowFbFree(screen);
     }
+    hostx_screen_fini(screen);
 }
 
 void
@@ -768,6 +1082,34 @@ ephyrCloseScreen(ScreenPtr pScreen)
     ephyrUnsetInternalDamage(pScreen);
 }
 
+/*
+ * Keycodes bound to each modifier by the keyboard's XKB modmap, and the
+ * modmap they were taken from, so they are only gathered again when the
+ * keymap changes.
+ */
+static CARD8 ephyrModMap[MAP_LENGTH];
+static CARD8 ephyrModKeys[8][MAP_LENGTH];
+static int ephyrModKeyCount[8];
+
+static void
+ephyrUpdateModifierKeys(const CARD8 *modmap)
+{
+    int key, i;
+
+    if (!memcmp(modmap, ephyrModMap, MAP_LENGTH))
+        return;
+
+    memcpy(ephyrModMap, modmap, MAP_LENGTH);
+    memset(ephyrModKeyCount, 0, sizeof(ephyrModKeyCount));
+
+    for (key = 0; key < MAP_LENGTH; key++) {
+        for (i = 0; i < 8; i++) {
+            if (modmap[key] & (1 << i))
+                ephyrModKeys[i][ephyrModKeyCount[i]++] = key;
+        }
+    }
+}
+
 /*  
  * Port of Mark McLoughlin's Xnest fix for focus in + modifier bug.
  * See https://bugs.freedesktop.org/show_bug.cgi?id=3030
@@ -777,7 +1119,6 @@ ephyrUpdateModifierState(unsigned int state)
 {
 
     DeviceIntPtr pDev = inputInfo.keyboard;
-    KeyClassPtr keyc = pDev->key;
     int i;
     CARD8 mask;
     int xkb_state;
@@ -791,32 +1132,26 @@ ephyrUpdateModifierState(unsigned int state)
     if (xkb_state == state)
         return;
 
+    ephyrUpdateModifierKeys(pDev->key->xkbInfo->desc->map->modmap);
+
     for (i = 0, mask = 1; i < 8; i++, mask <<= 1) {
-        int key;
+        int k;
 
         /* Modifier is down, but shouldn't be
          */
         if ((xkb_state & mask) && !(state & mask)) {
-            int count = keyc->modifierKeyCount[i];
+            for (k = 0; k < ephyrModKeyCount[i]; k++) {
+                int key = ephyrModKeys[i][k];
 
-            for (key = 0; key < MAP_LENGTH; key++)
-                if (keyc->xkbInfo->desc->map->modmap[key] & mask) {
-                    if (key_is_down(pDev, key, KEY_PROCESSED))
-                        KdEnqueueKeyboardEvent(ephyrKbd, key, TRUE);
-
-                    if (--count == 0)
-                        break;
-                }
+                if (key_is_down(pDev, key, KEY_PROCESSED))
+                    KdEnqueueKeyboardEvent(ephyrKbd, key, TRUE);
+            }
         }
 
         /* Modifier shoud be down, but isn't
          */
-        if (!(xkb_state & mask) && (state & mask))
-            for (key = 0; key < MAP_LENGTH; key++)
-                if (keyc->xkbInfo->desc->map->modmap[key] & mask) {
-                    KdEnqueueKeyboardEvent(ephyrKbd, key, FALSE);
-                    break;
-                }
+        if (!(xkb_state & mask) && (state & mask) && ephyrModKeyCount[i])
+            KdEnqueueKeyboardEvent(ephyrKbd, ephyrModKeys[i][0], FALSE);
     }
 }
 
@@ -886,22 +1221,7 @@ ephyrExposePairedWindow(int a_remote)
 static KdScreenInfo *
 screen_from_window(Window w)
 {
-    int i = 0;
-
-    for (i = 0; i < screenInfo.numScreens; i++) {
-        ScreenPtr pScreen = screenInfo.screens[i];
-        KdPrivScreenPtr kdscrpriv = KdGetScreenPriv(pScreen);
-        KdScreenInfo *screen = kdscrpriv->screen;
-        EphyrScrPriv *scrpriv = screen->driver;
-
-        if (scrpriv->win == w
-            || scrpriv->peer_win == w
-            || scrpriv->win_pre_existing == w) {
-            return screen;
-        }
-    }
-
-    return NULL;
+    return hostx_screen_from_window(w);
 }
 
 static void
@@ -934,9 +1254,7 @@ ephyrProcessExpose(xcb_generic_event_t *xev)
         return;
 
     if (scrpriv) {
-        hostx_paint_rect(scrpriv->screen, 0, 0, 0, 0,
-                         scrpriv->win_width,
-                         scrpriv->win_height);
+        ephyrDamageHostWindow(scrpriv->screen);
     } else {
         EPHYR_LOG_ERROR("failed to get host screen\n");
 #ifdef XF86DRI
@@ -1001,6 +1319,7 @@ ephyrProcessMouseMotion(xcb_generic_event_t *xev)
         y += screen->pScreen->y;
 
         KdEnqueuePointerEvent(ephyrMouse, mouseState | KD_POINTER_DESKTOP, x, y, 0);
+        ephyrNoteInput(screen, motion->time);
     }
 }
 
@@ -1023,6 +1342,7 @@ ephyrProcessButtonPress(xcb_generic_event_t *xev)
 
     EPHYR_LOG("enqueuing mouse press:%d\n", screen_from_window(button->event)->pScreen->myNum);
     KdEnqueuePointerEvent(ephyrMouse, mouseState | KD_MOUSE_DELTA, 0, 0, 0);
+    ephyrNoteInput(screen_from_window(button->event), button->time);
 }
 
 static void
@@ -1040,6 +1360,7 @@ ephyrProcessButtonRelease(xcb_generic_event_t *xev)
 
     EPHYR_LOG("enqueuing mouse release:%d\n", screen_from_window(button->event)->pScreen->myNum);
     KdEnqueuePointerEvent(ephyrMouse, mouseState | KD_MOUSE_DELTA, 0, 0, 0);
+    ephyrNoteInput(screen_from_window(button->event), button->time);
 }
 
 /* Xephyr wants ctrl+shift to grab the window, but that conflicts with
@@ -1070,6 +1391,13 @@ ephyrProcessKeyPress(xcb_generic_event_t *xev)
 {
     xcb_key_press_event_t *key = (xcb_key_press_event_t *)xev;
 
+    /* The host uses detectable autorepeat: a held key keeps sending
+     * presses and no releases.  Our own server does the repeating.
+     */
+    if (ephyrKeysDown[key->detail >> 3] & (1 << (key->detail & 7)))
+        return;
+    ephyrKeysDown[key->detail >> 3] |= 1 << (key->detail & 7);
+
     if (!ephyrKbd ||
         !((EphyrKbdPrivate *) ephyrKbd->driverPrivate)->enabled) {
         return;
@@ -1078,6 +1406,19 @@ ephyrProcessKeyPress(xcb_generic_event_t *xev)
     ephyrUpdateGrabModifierState(key->state);
     ephyrUpdateModifierState(key->state);
     KdEnqueueKeyboardEvent(ephyrKbd, key->detail, FALSE);
+    ephyrNoteInput(screen_from_window(key->event), key->time);
+}
+
+/* Releasing Shift with Control down, or the other way round */
+static Bool
+ephyrIsGrabToggle(xcb_key_release_event_t *key)
+{
+    int modifiers = hostx_get_key_modifiers(key->detail);
+
+    return (((modifiers & XCB_MOD_MASK_SHIFT)
+             && (key->state & XCB_MOD_MASK_CONTROL)) ||
+            ((modifiers & XCB_MOD_MASK_CONTROL)
+             && (key->state & XCB_MOD_MASK_SHIFT)));
 }
 
 static void
@@ -1085,19 +1426,12 @@ ephyrProcessKeyRelease(xcb_generic_event_t *xev)
 {
     xcb_connection_t *conn = hostx_get_xcbconn();
     xcb_key_release_event_t *key = (xcb_key_release_event_t *)xev;
-    static xcb_key_symbols_t *keysyms;
     static int grabbed_screen = -1;
     int mod1_down = ephyrUpdateGrabModifierState(key->state);
 
-    if (!keysyms)
-        keysyms = xcb_key_symbols_alloc(conn);
+    ephyrKeysDown[key->detail >> 3] &= ~(1 << (key->detail & 7));
 
-    if (((xcb_key_symbols_get_keysym(keysyms, key->detail, 0) == XK_Shift_L
-          || xcb_key_symbols_get_keysym(keysyms, key->detail, 0) == XK_Shift_R)
-         && (key->state & XCB_MOD_MASK_CONTROL)) ||
-        ((xcb_key_symbols_get_keysym(keysyms, key->detail, 0) == XK_Control_L
-          || xcb_key_symbols_get_keysym(keysyms, key->detail, 0) == XK_Control_R)
-         && (key->state & XCB_MOD_MASK_SHIFT))) {
+    if (ephyrIsGrabToggle(key)) {
         KdScreenInfo *screen = screen_from_window(key->event);
         EphyrScrPriv *scrpriv = screen->driver;
 
@@ -1105,6 +1439,9 @@ ephyrProcessKeyRelease(xcb_generic_event_t *xev)
             xcb_ungrab_keyboard(conn, XCB_TIME_CURRENT_TIME);
             xcb_ungrab_pointer(conn, XCB_TIME_CURRENT_TIME);
             grabbed_screen = -1;
+            ephyrRawMotion = hostx_select_raw_motion(FALSE);
+            ephyrRawDx = ephyrRawDy = 0;
+            ephyrRawTime = 0;
             hostx_set_win_title(screen,
                                 "(ctrl+shift grabs mouse and keyboard)");
         }
@@ -1141,6 +1478,8 @@ ephyrProcessKeyRelease(xcb_generic_event_t *xev)
                                             XCB_TIME_CURRENT_TIME);
                     } else {
                     grabbed_screen = scrpriv->mynum;
+                    /* relative motion, even past the window edges */
+                    ephyrRawMotion = hostx_select_raw_motion(TRUE);
                     hostx_set_win_title
                         (screen,
                          "(ctrl+shift releases mouse and keyboard)");
@@ -1161,6 +1500,29 @@ ephyrProcessKeyRelease(xcb_generic_event_t *xev)
      */
     ephyrUpdateModifierState(key->state);
     KdEnqueueKeyboardEvent(ephyrKbd, key->detail, TRUE);
+    ephyrNoteInput(screen_from_window(key->event), key->time);
+}
+
+/* Releases of keys held when the host window lost focus never reach
+ * us; release them here, or our server would keep repeating them. */
+static void
+ephyrProcessFocusOut(xcb_generic_event_t *xev)
+{
+    xcb_focus_out_event_t *focus = (xcb_focus_out_event_t *)xev;
+    int key;
+
+    if (focus->detail == XCB_NOTIFY_DETAIL_INFERIOR)
+        return;
+
+    for (key = 0; key < MAP_LENGTH; key++) {
+        if (!(ephyrKeysDown[key >> 3] & (1 << (key & 7))))
+            continue;
+
+        ephyrKeysDown[key >> 3] &= ~(1 << (key & 7));
+        if (ephyrKbd &&
+            ((EphyrKbdPrivate *) ephyrKbd->driverPrivate)->enabled)
+            KdEnqueueKeyboardEvent(ephyrKbd, key, TRUE);
+    }
 }
 
 static void
@@ -1181,67 +1543,574 @@ ephyrProcessConfigureNotify(xcb_generic_event_t *xev)
 #endif /* RANDR */
 }
 
-void
-ephyrPoll(void)
+static void
+ephyrProcessShmCompletion(xcb_generic_event_t *xev)
 {
-    xcb_connection_t *conn = hostx_get_xcbconn();
+    xcb_shm_completion_event_t *completion =
+        (xcb_shm_completion_event_t *)xev;
+    KdScreenInfo *screen = screen_from_window(completion->drawable);
+
+    if (!screen)
+        return;
+
+    hostx_paint_complete(screen, completion->shmseg);
+
+    /* Send out whatever got damaged while the put was in flight, if the
+     * next frame is due; the block handler waits for it otherwise. */
+    ephyrScheduleRedisplay(screen->pScreen);
+}
+
+/**
+ * Enqueue the whole pixels of the raw motion gathered so far.  Fractions
+ * are kept for the next event, as kdrive only takes integer deltas.
+ */
+static void
+ephyrFlushRawMotion(void)
+{
+    int dx = (int) ephyrRawDx;
+    int dy = (int) ephyrRawDy;
+    xcb_timestamp_t time = ephyrRawTime;
+
+    if (!dx && !dy)
+        return;
+
+    ephyrRawDx -= dx;
+    ephyrRawDy -= dy;
+    ephyrRawTime = 0;
+
+    if (!ephyrMouse ||
+        !((EphyrPointerPrivate *) ephyrMouse->driverPrivate)->enabled)
+        return;
+
+    KdEnqueuePointerEvent(ephyrMouse, mouseState | KD_MOUSE_DELTA, dx, dy, 0);
+    if (ephyrCursorScreen) {
+        KdScreenPriv(ephyrCursorScreen);
+
+        ephyrNoteInput(pScreenPriv->screen, time);
+    }
+}
+
+/* Host motion held back by ephyrProcessEvent(), kept by value since the
+ * event it came in may be reused as soon as it has been processed */
+typedef struct {
+    Bool pending;
+    xcb_motion_notify_event_t event;
+} EphyrHeldMotion;
+
+/*
+ * Enqueue the motion ephyrPoll() held back, if any.  Motion is only
+ * delivered when some other event, motion in another window or the end
+ * of the queue comes along, so a burst of motion costs one pointer event
+ * while buttons and keys still see the position they happened at.
+ */
+static void
+ephyrFlushMotion(EphyrHeldMotion *motion)
+{
+    ephyrFlushRawMotion();
 
-    while (TRUE) {
-        xcb_generic_event_t *xev = xcb_poll_for_event(conn);
-        if (!xev) {
-            /* If our XCB connection has died (for example, our window was
-             * closed), exit now.
-             */
-            if (xcb_connection_has_error(conn)) {
-                CloseWellKnownConnections();
-                OsCleanup(1);
-                exit(1);
+    if (!motion->pending)
+        return;
+
+    ephyrProcessMouseMotion((xcb_generic_event_t *) &motion->event);
+    motion->pending = FALSE;
+}
+
+/**
+ * Hand one host event to its handler.  The event stays the caller's to
+ * free.  Motion is held back in @motion until something else arrives, as
+ * only the latest position matters.
+ */
+static void
+ephyrProcessEvent(xcb_generic_event_t *xev, EphyrHeldMotion *motion)
+{
+    xcb_timestamp_t time;
+    double dx, dy;
+
+    if (hostx_get_raw_motion(xev, &dx, &dy, &time)) {
+        if (ephyrRawMotion) {
+            ephyrRawDx += dx;
+            ephyrRawDy += dy;
+            if (!ephyrRawTime)
+                ephyrRawTime = time;
+        }
+        return;
+    }
+
+    if ((xev->response_type & 0x7f) == XCB_MOTION_NOTIFY) {
+        xcb_motion_notify_event_t *move = (xcb_motion_notify_event_t *) xev;
+
+        /* the raw deltas already moved the pointer */
+        if (ephyrRawMotion)
+            return;
+
+        if (motion->pending && motion->event.event != move->event)
+            ephyrFlushMotion(motion);
+
+        motion->event = *move;
+        motion->pending = TRUE;
+        return;
+    }
+
+    ephyrFlushMotion(motion);
+
+    switch (xev->response_type & 0x7f) {
+    case 0:
+        ephyrProcessErrorEvent(xev);
+        break;
+
+    case XCB_EXPOSE:
+        ephyrProcessExpose(xev);
+        break;
+
+    case XCB_KEY_PRESS:
+        ephyrProcessKeyPress(xev);
+        break;
+
+    case XCB_KEY_RELEASE:
+        ephyrProcessKeyRelease(xev);
+        break;
+
+    case XCB_BUTTON_PRESS:
+        ephyrProcessButtonPress(xev);
+        break;
+
+    case XCB_BUTTON_RELEASE:
+        ephyrProcessButtonRelease(xev);
+        break;
+
+    case XCB_CONFIGURE_NOTIFY:
+        ephyrProcessConfigureNotify(xev);
+        break;
+
+    case XCB_FOCUS_OUT:
+        ephyrProcessFocusOut(xev);
+        break;
+
+    case XCB_MAPPING_NOTIFY:
+        if (((xcb_mapping_notify_event_t *) xev)->request !=
+            XCB_MAPPING_POINTER)
+            hostx_load_keymap();
+        break;
+
+    default:
+        if (hostx_is_shm_completion(xev))
+            ephyrProcessShmCompletion(xev);
+        else if (hostx_is_keymap_notify(xev))
+            hostx_load_keymap();
+        break;
+    }
+
+    /* Core device events have no Xlib-side filtering to run, and may be
+     * processed from the SIGIO handler where Xlib can't be locked.
+     */
+    if (ephyr_glamor && ((xev->response_type & 0x7f) < XCB_KEY_PRESS ||
+                         (xev->response_type & 0x7f) > XCB_MOTION_NOTIFY)) {
+        KdScreenInfo *screen =
+            screen_from_window(ephyr_glamor_process_event(xev));
+
+        /* a swap completed: paint what was damaged meanwhile */
+        if (screen)
+            ephyrScheduleRedisplay(screen->pScreen);
+    }
+}
+
+/*
+ * Host events are read on their own thread when possible.  Pointer and
+ * keyboard events reach the input queue from the SIGIO handler on the
+ * main thread, so they are enqueued (and timestamped) even while a frame
+ * is being converted and uploaded; everything else, and any input queued
+ * behind it, waits for ephyrPoll().  The main thread holds SIGIO off
+ * while it takes events, so they are always processed in host order.
+ *
+ * The SIGIO handler may interrupt malloc() or anything else, so the queue
+ * takes no locks and the handler frees nothing: the thread copies events
+ * into preallocated slots, frees what xcb gave it, and hands over the
+ * slots through atomic indices and a semaphore counting the free ones.
+ * Events too big for a slot go through as they are, for the main thread
+ * to process and free.
+ */
+#define EPHYR_INPUT_QUEUE_SIZE 1024
+#define EPHYR_INPUT_EVENT_SIZE 256
+
+Bool ephyrNoInputThread = FALSE;
+
+typedef struct {
+    xcb_generic_event_t *heap;  /* too big to copy, or NULL */
+    union {
+        xcb_generic_event_t event;
+        CARD8 bytes[EPHYR_INPUT_EVENT_SIZE];
+    } copy;
+} EphyrInputSlot;
+
+static struct {
+    pthread_t thread;
+    Bool running;
+    sem_t free_slots;
+    EphyrInputSlot slots[EPHYR_INPUT_QUEUE_SIZE];
+    unsigned int head;          /* next slot to take, main thread only */
+    unsigned int tail;          /* next slot to fill, input thread only */
+    int wake_fd[2];             /* written when the queue stops being empty */
+} ephyrInput = {
+    .wake_fd = { -1, -1 },
+};
+
+/* What xcb allocated for @xev: GE events carry @length more words */
+static size_t
+ephyrEventSize(xcb_generic_event_t *xev)
+{
+    if ((xev->response_type & 0x7f) == XCB_GE_GENERIC)
+        return sizeof(*xev) + ((xcb_ge_generic_event_t *) xev)->length * 4;
+    return sizeof(*xev);
+}
+
+static void *
+ephyrInputThread(void *closure)
+{
+    xcb_connection_t *conn = closure;
+    xcb_generic_event_t *xev;
+
+    do {
+        EphyrInputSlot *slot;
+        unsigned int tail = ephyrInput.tail;
+
+        /* NULL once the connection has died; ephyrPoll() notices */
+        xev = xcb_wait_for_event(conn);
+
+        if (xev) {
+            while (sem_wait(&ephyrInput.free_slots) < 0 && errno == EINTR)
+                ;
+
+            slot = &ephyrInput.slots[tail % EPHYR_INPUT_QUEUE_SIZE];
+            if (ephyrEventSize(xev) <= sizeof(slot->copy)) {
+                memcpy(&slot->copy, xev, ephyrEventSize(xev));
+                free(xev);
+                slot->heap = NULL;
             }
+            else
+                slot->heap = xev;
 
-            break;
+            __atomic_store_n(&ephyrInput.tail, tail + 1, __ATOMIC_SEQ_CST);
         }
 
-        switch (xev->response_type & 0x7f) {
-        case 0:
-            ephyrProcessErrorEvent(xev);
-            break;
+        /* the main thread may have emptied the queue and gone to sleep */
+        if ((!xev ||
+             __atomic_load_n(&ephyrInput.head, __ATOMIC_SEQ_CST) == tail) &&
+            write(ephyrInput.wake_fd[1], "", 1) < 0) {
+            /* pipe full: the main thread has a wakeup pending anyway */
+        }
+    } while (xev);
 
-        case XCB_EXPOSE:
-            ephyrProcessExpose(xev);
-            break;
+    return NULL;
+}
 
-        case XCB_MOTION_NOTIFY:
-            ephyrProcessMouseMotion(xev);
-            break;
+/**
+ * Whether @xev only feeds the input queue, so that the SIGIO handler
+ * may process it.
+ */
+static Bool
+ephyrIsDirectInput(xcb_generic_event_t *xev)
+{
+    KdScreenInfo *screen;
+    xcb_timestamp_t time;
+    double dx, dy;
+
+    switch (xev->response_type & 0x7f) {
+    case XCB_MOTION_NOTIFY:
+        if (ephyrRawMotion)
+            return TRUE;
+        /* moving to another screen warps the cursor */
+        screen = screen_from_window(((xcb_motion_notify_event_t *) xev)->event);
+        return screen && screen->pScreen == ephyrCursorScreen;
+
+    case XCB_GE_GENERIC:
+        return hostx_get_raw_motion(xev, &dx, &dy, &time);
+
+    case XCB_KEY_RELEASE:
+        /* toggling the grab talks to the host */
+        return !ephyrIsGrabToggle((xcb_key_release_event_t *) xev);
+
+    case XCB_KEY_PRESS:
+    case XCB_BUTTON_PRESS:
+    case XCB_BUTTON_RELEASE:
+        return TRUE;
+
+    default:
+        return FALSE;
+    }
+}
 
-        case XCB_KEY_PRESS:
-            ephyrProcessKeyPress(xev);
-            break;
+/**
+ * The oldest event the input thread has read, or NULL.  With
+ * @direct_only, NULL as well if the SIGIO handler can't process it.  The
+ * event stays queued until ephyrInputRelease().
+ */
+static xcb_generic_event_t *
+ephyrInputPeek(Bool direct_only)
+{
+    unsigned int head = ephyrInput.head;
+    EphyrInputSlot *slot;
+    xcb_generic_event_t *xev;
 
-        case XCB_KEY_RELEASE:
-            ephyrProcessKeyRelease(xev);
-            break;
+    if (head == __atomic_load_n(&ephyrInput.tail, __ATOMIC_SEQ_CST))
+        return NULL;
 
-        case XCB_BUTTON_PRESS:
-            ephyrProcessButtonPress(xev);
-            break;
+    slot = &ephyrInput.slots[head % EPHYR_INPUT_QUEUE_SIZE];
+    xev = slot->heap ? slot->heap : &slot->copy.event;
 
-        case XCB_BUTTON_RELEASE:
-            ephyrProcessButtonRelease(xev);
-            break;
+    /* only the main thread may free */
+    if (direct_only && (slot->heap || !ephyrIsDirectInput(xev)))
+        return NULL;
+
+    return xev;
+}
+
+/* Done with the event ephyrInputPeek() returned: hand its slot back */
+static void
+ephyrInputRelease(void)
+{
+    unsigned int head = ephyrInput.head;
+    EphyrInputSlot *slot = &ephyrInput.slots[head % EPHYR_INPUT_QUEUE_SIZE];
+
+    /* never so from the SIGIO handler, see ephyrInputPeek() */
+    if (slot->heap) {
+        free(slot->heap);
+        slot->heap = NULL;
+    }
+    __atomic_store_n(&ephyrInput.head, head + 1, __ATOMIC_SEQ_CST);
+    sem_post(&ephyrInput.free_slots);
+}
+
+static void
+ephyrInputSigio(int fd, void *closure)
+{
+    EphyrHeldMotion motion = { FALSE };
+    xcb_generic_event_t *xev;
+    int saved_errno = errno;
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
 
-        case XCB_CONFIGURE_NOTIFY:
-            ephyrProcessConfigureNotify(xev);
+    while ((xev = ephyrInputPeek(TRUE))) {
+        ephyrProcessEvent(xev, &motion);
+        ephyrInputRelease();
+    }
+    ephyrFlushMotion(&motion);
+
+    errno = saved_errno;
+}
+
+/**
+ * Start the input thread, once.  Host events are read on the main
+ * thread if this fails.
+ */
+static void
+ephyrInputThreadInit(void)
+{
+    static Bool tried = FALSE;
+    sigset_t blocked, saved;
+
+    if (tried || ephyrNoInputThread)
+        return;
+    tried = TRUE;
+
+    if (sem_init(&ephyrInput.free_slots, 0, EPHYR_INPUT_QUEUE_SIZE) < 0) {
+        ErrorF("Xephyr: no input thread, sem_init failed: %s\n",
+               strerror(errno));
+        return;
+    }
+    if (pipe(ephyrInput.wake_fd) < 0) {
+        ErrorF("Xephyr: no input thread, pipe failed: %s\n", strerror(errno));
+        sem_destroy(&ephyrInput.free_slots);
+        return;
+    }
+    fcntl(ephyrInput.wake_fd[1], F_SETFL, O_NONBLOCK);
+
+    /* SIGIO and friends must only ever interrupt the main thread */
+    sigfillset(&blocked);
+    pthread_sigmask(SIG_BLOCK, &blocked, &saved);
+    if (pthread_create(&ephyrInput.thread, NULL, ephyrInputThread,
+                       hostx_get_xcbconn()) == 0) {
+        pthread_detach(ephyrInput.thread);
+        ephyrInput.running = TRUE;
+    }
+    else {
+        ErrorF("Xephyr: couldn't start the input thread\n");
+        sem_destroy(&ephyrInput.free_slots);
+        close(ephyrInput.wake_fd[0]);
+        close(ephyrInput.wake_fd[1]);
+        ephyrInput.wake_fd[0] = ephyrInput.wake_fd[1] = -1;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+/* The host connection, while ephyrHostWakeupHandler() watches it */
+static int ephyrHostFd = -1;
+static Bool ephyrHostHandlers = FALSE;
+
+/*
+ * Most host events one call of ephyrProcessHostEvents() handles, and for
+ * how many milliseconds, before clients and painting get their turn; a
+ * quarter of that while damage is waiting to be painted.  What is left
+ * is handled on the next loop iteration, which doesn't sleep.
+ */
+#define EPHYR_POLL_EVENTS 512
+#define EPHYR_POLL_MSEC 8
+
+static Bool ephyrHostEventsDeferred = FALSE;
+
+static Bool
+ephyrPaintPending(void)
+{
+    int i;
+
+    for (i = 0; i < screenInfo.numScreens; i++) {
+        KdScreenPriv(screenInfo.screens[i]);
+        RegionPtr pRegion = ephyrRedisplayRegion(pScreenPriv->screen->driver);
+
+        if (pRegion && RegionNotEmpty(pRegion))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static xcb_generic_event_t *
+ephyrNextHostEvent(xcb_connection_t *conn, Bool read_host)
+{
+    if (ephyrInput.running)
+        return ephyrInputPeek(FALSE);
+    if (read_host)
+        return xcb_poll_for_event(conn);
+    return xcb_poll_for_queued_event(conn);
+}
+
+/* Done with the event ephyrNextHostEvent() returned */
+static void
+ephyrReleaseHostEvent(xcb_generic_event_t *xev)
+{
+    if (ephyrInput.running)
+        ephyrInputRelease();
+    else
+        free(xev);
+}
+
+/**
+ * Process host events, reading them from the connection only if
+ * @read_host; otherwise just those that already came in with replies.
+ */
+static void
+ephyrProcessHostEvents(Bool read_host)
+{
+    xcb_connection_t *conn = hostx_get_xcbconn();
+    EphyrHeldMotion motion = { FALSE };
+    xcb_generic_event_t *xev;
+    int budget = EPHYR_POLL_EVENTS, msec = EPHYR_POLL_MSEC;
+    CARD32 deadline;
+    int n = 0;
+
+    if (ephyrPaintPending()) {
+        budget /= 4;
+        msec /= 4;
+    }
+    deadline = GetTimeInMillis() + msec;
+
+    if (ephyrInput.running)
+        OsBlockSIGIO();
+
+    ephyrHostEventsDeferred = FALSE;
+    while ((xev = ephyrNextHostEvent(conn, read_host))) {
+        ephyrProcessEvent(xev, &motion);
+        ephyrReleaseHostEvent(xev);
+
+        if (++n == budget ||
+            (!(n & 15) && (int) (GetTimeInMillis() - deadline) >= 0)) {
+            ephyrHostEventsDeferred = TRUE;
             break;
         }
+    }
+    ephyrFlushMotion(&motion);
 
-        if (ephyr_glamor)
-            ephyr_glamor_process_event(xev);
+    if (ephyrInput.running)
+        OsReleaseSIGIO();
 
-        free(xev);
+    /* If our XCB connection has died (for example, our window was
+     * closed), exit now.
+     */
+    if (xcb_connection_has_error(conn)) {
+        CloseWellKnownConnections();
+        OsCleanup(1);
+        exit(1);
     }
 }
 
+static void
+ephyrHostBlockHandler(void *data, OSTimePtr pTimeout, void *pRead)
+{
+    /* ephyrPoll() ran out of budget: come straight back for the rest */
+    if (ephyrHostEventsDeferred)
+        AdjustWaitForDelay(pTimeout, 0);
+}
+
+static void
+ephyrHostWakeupHandler(void *data, int result, void *read_mask)
+{
+    if (ephyrHostFd >= 0 && result > 0 &&
+        FD_ISSET(ephyrHostFd, (fd_set *) read_mask))
+        ephyrProcessHostEvents(TRUE);
+}
+
+/**
+ * Called by kdrive before each sleep: the last chance to process events
+ * read along with replies, which won't make the connection readable.
+ */
+void
+ephyrPoll(void)
+{
+    ephyrProcessHostEvents(ephyrHostFd < 0);
+
+    if (ephyrLatencyDumpWanted) {
+        ephyrLatencyDumpWanted = 0;
+        ephyrLatencyDump();
+    }
+}
+
+/**
+ * Hook host event handling into the main loop.  Without the input
+ * thread, the connection is then only read when select() finds it
+ * readable.
+ */
+static void
+ephyrWatchHostFd(void)
+{
+    if (ephyrHostHandlers)
+        return;
+
+    if (!RegisterBlockAndWakeupHandlers(ephyrHostBlockHandler,
+                                        ephyrHostWakeupHandler, NULL))
+        return;
+    ephyrHostHandlers = TRUE;
+
+    if (!ephyrInput.running) {
+        ephyrHostFd = xcb_get_file_descriptor(hostx_get_xcbconn());
+        AddEnabledDevice(ephyrHostFd);
+    }
+}
+
+static void
+ephyrUnwatchHostFd(void)
+{
+    if (!ephyrHostHandlers)
+        return;
+
+    if (ephyrHostFd >= 0)
+        RemoveEnabledDevice(ephyrHostFd);
+    RemoveBlockAndWakeupHandlers(ephyrHostBlockHandler,
+                                 ephyrHostWakeupHandler, NULL);
+    ephyrHostHandlers = FALSE;
+    ephyrHostFd = -1;
+}
+
 void
 ephyrCardFini(KdCardInfo * card)
 {
@@ -1333,6 +2202,20 @@ static Status
 MouseEnable(KdPointerInfo * pi)
 {
     ((EphyrPointerPrivate *) pi->driverPrivate)->enabled = TRUE;
+
+    ephyrInputThreadInit();
+    if (ephyrInput.running) {
+        KdRegisterFd(ephyrInput.wake_fd[0], ephyrInputSigio, pi);
+#ifdef F_SETOWN_EX
+        {
+            /* KdRegisterFd() signals the process; aim at this thread */
+            struct f_owner_ex owner = { F_OWNER_TID, syscall(SYS_gettid) };
+
+            fcntl(ephyrInput.wake_fd[0], F_SETOWN_EX, &owner);
+        }
+#endif
+    }
+    ephyrWatchHostFd();
     return Success;
 }
 
@@ -1340,6 +2223,9 @@ static void
 MouseDisable(KdPointerInfo * pi)
 {
     ((EphyrPointerPrivate *) pi->driverPrivate)->enabled = FALSE;
+    if (ephyrInput.running)
+        KdUnregisterFd(pi, ephyrInput.wake_fd[0], FALSE);
+    ephyrUnwatchHostFd();
     return;
 }
 
@@ -34,6 +34,7 @@
 #include "os.h"                 /* for OsSignal() */
 #include "kdrive.h"
 #include "hostx.h"
+#include "ephyr_convert.h"
 #include "exa.h"
 
 #ifdef RANDR
@@ -42,6 +43,9 @@
 
 #include "damage.h"
 
+/* Frames per second painted to the host, unless -fps says otherwise */
+#define EPHYR_DEFAULT_FPS 60
+
 typedef struct _ephyrPriv {
     CARD8 *base;
     int bytes_per_line;
@@ -61,25 +65,61 @@ typedef struct _ephyrFakexaPriv {
     GCPtr pGC;
 } EphyrFakexaPriv;
 
+/* Most host images (SHM segments) a screen can paint through */
+#define EPHYR_MAX_HOST_IMAGES 3
+
+/* Longest the host may take to complete a SHM put, in milliseconds,
+ * before the segment is written to again anyway */
+#define EPHYR_SHM_PUT_TIMEOUT 100
+
+typedef struct _ephyrHostImage {
+    xcb_image_t *ximg;
+    xcb_shm_segment_info_t shminfo;   /* shmaddr is NULL without SHM */
+    int puts_pending;                 /* SHM puts not yet completed by host */
+    CARD32 put_time;                  /* when the last of them was sent */
+    size_t shm_size;                  /* memfd segment: bytes mapped, or 0 */
+    int shm_fd;                       /* memfd backing shmaddr, if shm_size */
+} EphyrHostImage;
+
+/* Input latency histogram, in log2 buckets of milliseconds: [0,1),
+ * [1,2), [2,4) and so on, the last bucket counting anything longer.
+ */
+#define EPHYR_LATENCY_BUCKETS 12
+
+typedef struct _ephyrLatency {
+    CARD32 count[EPHYR_LATENCY_BUCKETS];
+} EphyrLatency;
+
 typedef struct _ephyrScrPriv {
     /* ephyr server info */
     Rotation randr;
     Bool shadow;
     DamagePtr pDamage;
+    RegionRec shadow_damage;    /* rotated: boxes shadow updated, unpainted */
+    Bool redisplay;             /* painting on the redisplay schedule */
+    CARD32 next_redisplay;      /* when the next frame may be painted */
+    EphyrLatency host_latency;  /* host event to our input queue */
+    EphyrLatency paint_latency; /* our input queue to the next paint */
+    Bool input_pending;         /* input enqueued since the last paint, */
+    CARD32 input_time;          /* the oldest of it at this time */
     EphyrFakexaPriv *fakexa;
 
     /* Host X window info */
     xcb_window_t win;
     xcb_window_t win_pre_existing;    /* Set via -parent option like xnest */
     xcb_window_t peer_win;            /* Used for GL; should be at most one */
-    xcb_image_t *ximg;
+    EphyrHostImage images[EPHYR_MAX_HOST_IMAGES];
+    int n_images;
+    int cur_image;              /* image the last paint went through */
     Bool win_explicit_position;
     int win_x, win_y;
     int win_width, win_height;
     int server_depth;
     const char *output;         /* Set via -output option */
-    unsigned char *fb_data;     /* only used when host bpp != server bpp */
-    xcb_shm_segment_info_t shminfo;
+    unsigned char *fb_data;     /* only used when host bpp != server bpp
+                                 * or with several host images */
+    int fb_stride;
+    EphyrConvert *convert;      /* fb_data to host image */
 
     KdScreenInfo *screen;
     int mynum;                  /* Screen number */
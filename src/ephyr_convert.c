@@ -0,0 +1,646 @@
+/*
+ * Copyright (C) 2014 Prefeitura de Mogi das Cruzes, SP, Brazil
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file ephyr_convert.c
+ *
+ * Pixel format conversion between the Xephyr framebuffer and the host
+ * image, for screens running at a lower depth than the host.
+ *
+ * Every converter works on one row at a time.  Any server depth can be
+ * drawn into any TrueColor host layout, whatever its masks and byte order,
+ * through lookup tables that already hold host pixels in host byte order.
+ * A few common combinations have SIMD variants, picked at runtime, once
+ * per screen, by ephyr_convert_create().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <kdrive-config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <xcb/xproto.h>
+
+#include "ephyr_convert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EPHYR_CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define EPHYR_CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define EPHYR_NATIVE_ORDER XCB_IMAGE_ORDER_MSB_FIRST
+#else
+#define EPHYR_NATIVE_ORDER XCB_IMAGE_ORDER_LSB_FIRST
+#endif
+
+/* size of each channel table of a 24 or 30 bit server */
+#define EPHYR_CHANNEL_LUT_SIZE 1024
+
+/* Expand a 565 pixel to x8r8g8b8, replicating the high bits so that
+ * full intensity stays full intensity.
+ */
+static inline uint32_t
+ephyr_expand_565(uint16_t p)
+{
+    uint32_t r = p >> 11, g = (p >> 5) & 0x3f, b = p & 0x1f;
+
+    r = (r << 3) | (r >> 2);
+    g = (g << 2) | (g >> 4);
+    b = (b << 3) | (b >> 2);
+
+    return (r << 16) | (g << 8) | b;
+}
+
+static void
+ephyr_convert_565_8888_c(const EphyrConvert *conv,
+                         uint8_t *dst, const uint8_t *src, int width)
+{
+    const uint16_t *s = (const uint16_t *) src;
+    uint32_t *d = (uint32_t *) dst;
+    int i;
+
+    (void) conv;
+
+    for (i = 0; i < width; i++)
+        d[i] = ephyr_expand_565(s[i]);
+}
+
+/* Table driven converters, one per server and host pixel size.  16 and
+ * 32 bit host pixels are stored as native words, which the table has
+ * already swapped if needed; 24 bit host pixels are stored a byte at a
+ * time, lowest table byte first.
+ */
+
+static void
+ephyr_convert_8_32_c(const EphyrConvert *conv,
+                     uint8_t *dst, const uint8_t *src, int width)
+{
+    const uint32_t *lut = conv->lut;
+    uint32_t *d = (uint32_t *) dst;
+    int i;
+
+    for (i = 0; i + 4 <= width; i += 4) {
+        d[i + 0] = lut[src[i + 0]];
+        d[i + 1] = lut[src[i + 1]];
+        d[i + 2] = lut[src[i + 2]];
+        d[i + 3] = lut[src[i + 3]];
+    }
+    for (; i < width; i++)
+        d[i] = lut[src[i]];
+}
+
+static void
+ephyr_convert_8_24_c(const EphyrConvert *conv,
+                     uint8_t *dst, const uint8_t *src, int width)
+{
+    int i;
+
+    for (i = 0; i < width; i++, dst += 3) {
+        uint32_t p = conv->lut[src[i]];
+
+        dst[0] = p;
+        dst[1] = p >> 8;
+        dst[2] = p >> 16;
+    }
+}
+
+static void
+ephyr_convert_8_16_c(const EphyrConvert *conv,
+                     uint8_t *dst, const uint8_t *src, int width)
+{
+    uint16_t *d = (uint16_t *) dst;
+    int i;
+
+    for (i = 0; i < width; i++)
+        d[i] = conv->lut[src[i]];
+}
+
+static void
+ephyr_convert_16_32_c(const EphyrConvert *conv,
+                      uint8_t *dst, const uint8_t *src, int width)
+{
+    const uint16_t *s = (const uint16_t *) src;
+    const uint32_t *lut = conv->lut;
+    uint32_t *d = (uint32_t *) dst;
+    int i;
+
+    for (i = 0; i + 4 <= width; i += 4) {
+        d[i + 0] = lut[s[i + 0]];
+        d[i + 1] = lut[s[i + 1]];
+        d[i + 2] = lut[s[i + 2]];
+        d[i + 3] = lut[s[i + 3]];
+    }
+    for (; i < width; i++)
+        d[i] = lut[s[i]];
+}
+
+static void
+ephyr_convert_16_24_c(const EphyrConvert *conv,
+                      uint8_t *dst, const uint8_t *src, int width)
+{
+    const uint16_t *s = (const uint16_t *) src;
+    int i;
+
+    for (i = 0; i < width; i++, dst += 3) {
+        uint32_t p = conv->lut[s[i]];
+
+        dst[0] = p;
+        dst[1] = p >> 8;
+        dst[2] = p >> 16;
+    }
+}
+
+static void
+ephyr_convert_16_16_c(const EphyrConvert *conv,
+                      uint8_t *dst, const uint8_t *src, int width)
+{
+    const uint16_t *s = (const uint16_t *) src;
+    uint16_t *d = (uint16_t *) dst;
+    int i;
+
+    for (i = 0; i < width; i++)
+        d[i] = conv->lut[s[i]];
+}
+
+static inline uint32_t
+ephyr_convert_lookup_32(const EphyrConvert *conv, uint32_t p)
+{
+    const uint32_t *lut = conv->lut;
+
+    return lut[(p >> conv->channel_shift[0]) & conv->channel_mask[0]] |
+        lut[EPHYR_CHANNEL_LUT_SIZE +
+            ((p >> conv->channel_shift[1]) & conv->channel_mask[1])] |
+        lut[2 * EPHYR_CHANNEL_LUT_SIZE +
+            ((p >> conv->channel_shift[2]) & conv->channel_mask[2])];
+}
+
+static void
+ephyr_convert_32_32_c(const EphyrConvert *conv,
+                      uint8_t *dst, const uint8_t *src, int width)
+{
+    const uint32_t *s = (const uint32_t *) src;
+    uint32_t *d = (uint32_t *) dst;
+    int i;
+
+    for (i = 0; i < width; i++)
+        d[i] = ephyr_convert_lookup_32(conv, s[i]);
+}
+
+static void
+ephyr_convert_32_24_c(const EphyrConvert *conv,
+                      uint8_t *dst, const uint8_t *src, int width)
+{
+    const uint32_t *s = (const uint32_t *) src;
+    int i;
+
+    for (i = 0; i < width; i++, dst += 3) {
+        uint32_t p = ephyr_convert_lookup_32(conv, s[i]);
+
+        dst[0] = p;
+        dst[1] = p >> 8;
+        dst[2] = p >> 16;
+    }
+}
+
+static void
+ephyr_convert_32_16_c(const EphyrConvert *conv,
+                      uint8_t *dst, const uint8_t *src, int width)
+{
+    const uint32_t *s = (const uint32_t *) src;
+    uint16_t *d = (uint16_t *) dst;
+    int i;
+
+    for (i = 0; i < width; i++)
+        d[i] = ephyr_convert_lookup_32(conv, s[i]);
+}
+
+#ifdef EPHYR_CONVERT_X86
+__attribute__((target("sse2")))
+static void
+ephyr_convert_565_8888_sse2(const EphyrConvert *conv,
+                            uint8_t *dst, const uint8_t *src, int width)
+{
+    const __m128i mask_6 = _mm_set1_epi16(0x3f);
+    const __m128i mask_5 = _mm_set1_epi16(0x1f);
+    int i;
+
+    for (i = 0; i + 8 <= width; i += 8) {
+        __m128i p = _mm_loadu_si128((const __m128i *) (src + i * 2));
+        __m128i r = _mm_srli_epi16(p, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), mask_6);
+        __m128i b = _mm_and_si128(p, mask_5);
+        __m128i gb;
+
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+        gb = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+
+        _mm_storeu_si128((__m128i *) (dst + i * 4),
+                         _mm_unpacklo_epi16(gb, r));
+        _mm_storeu_si128((__m128i *) (dst + i * 4 + 16),
+                         _mm_unpackhi_epi16(gb, r));
+    }
+
+    ephyr_convert_565_8888_c(conv, dst + i * 4, src + i * 2, width - i);
+}
+
+__attribute__((target("avx2")))
+static void
+ephyr_convert_565_8888_avx2(const EphyrConvert *conv,
+                            uint8_t *dst, const uint8_t *src, int width)
+{
+    const __m256i mask_6 = _mm256_set1_epi16(0x3f);
+    const __m256i mask_5 = _mm256_set1_epi16(0x1f);
+    int i;
+
+    for (i = 0; i + 16 <= width; i += 16) {
+        __m256i p = _mm256_loadu_si256((const __m256i *) (src + i * 2));
+        __m256i r = _mm256_srli_epi16(p, 11);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi16(p, 5), mask_6);
+        __m256i b = _mm256_and_si256(p, mask_5);
+        __m256i gb, lo, hi;
+
+        r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+        g = _mm256_or_si256(_mm256_slli_epi16(g, 2), _mm256_srli_epi16(g, 4));
+        b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+        gb = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+
+        /* unpack works within 128 bit lanes: put pixels back in order */
+        lo = _mm256_unpacklo_epi16(gb, r);
+        hi = _mm256_unpackhi_epi16(gb, r);
+        _mm256_storeu_si256((__m256i *) (dst + i * 4),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *) (dst + i * 4 + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    ephyr_convert_565_8888_sse2(conv, dst + i * 4, src + i * 2, width - i);
+}
+
+__attribute__((target("avx2")))
+static void
+ephyr_convert_8_32_avx2(const EphyrConvert *conv,
+                        uint8_t *dst, const uint8_t *src, int width)
+{
+    int i;
+
+    for (i = 0; i + 8 <= width; i += 8) {
+        __m256i idx = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i *) (src + i)));
+
+        _mm256_storeu_si256((__m256i *) (dst + i * 4),
+                            _mm256_i32gather_epi32((const int *) conv->lut,
+                                                   idx, 4));
+    }
+
+    ephyr_convert_8_32_c(conv, dst + i * 4, src + i, width - i);
+}
+#endif /* EPHYR_CONVERT_X86 */
+
+#ifdef EPHYR_CONVERT_NEON
+static void
+ephyr_convert_565_8888_neon(const EphyrConvert *conv,
+                            uint8_t *dst, const uint8_t *src, int width)
+{
+    int i;
+
+    for (i = 0; i + 8 <= width; i += 8) {
+        uint16x8_t p = vld1q_u16((const uint16_t *) (src + i * 2));
+        uint8x8x4_t out;
+
+        out.val[2] = vshrn_n_u16(p, 8);                 /* rrrrrggg */
+        out.val[1] = vshrn_n_u16(p, 3);                 /* ggggggbb */
+        out.val[0] = vmovn_u16(vshlq_n_u16(p, 3));      /* bbbbb000 */
+        out.val[2] = vsri_n_u8(out.val[2], out.val[2], 5);
+        out.val[1] = vsri_n_u8(out.val[1], out.val[1], 6);
+        out.val[0] = vsri_n_u8(out.val[0], out.val[0], 5);
+        out.val[3] = vdup_n_u8(0);
+
+        vst4_u8(dst + i * 4, out);
+    }
+
+    ephyr_convert_565_8888_c(conv, dst + i * 4, src + i * 2, width - i);
+}
+#endif /* EPHYR_CONVERT_NEON */
+
+static int
+ephyr_convert_have_simd(const char *feature)
+{
+    if (getenv("XEPHYR_NO_SIMD"))
+        return 0;
+
+#ifdef EPHYR_CONVERT_X86
+    __builtin_cpu_init();
+    if (!strcmp(feature, "sse2"))
+        return __builtin_cpu_supports("sse2");
+    if (!strcmp(feature, "avx2"))
+        return __builtin_cpu_supports("avx2");
+#endif
+#ifdef EPHYR_CONVERT_NEON
+    if (!strcmp(feature, "neon"))
+        return 1;
+#endif
+    return 0;
+}
+
+static EphyrConvertRowProc
+ephyr_convert_find_565_8888(void)
+{
+#ifdef EPHYR_CONVERT_X86
+    if (ephyr_convert_have_simd("avx2"))
+        return ephyr_convert_565_8888_avx2;
+    if (ephyr_convert_have_simd("sse2"))
+        return ephyr_convert_565_8888_sse2;
+#endif
+#ifdef EPHYR_CONVERT_NEON
+    if (ephyr_convert_have_simd("neon"))
+        return ephyr_convert_565_8888_neon;
+#endif
+    return ephyr_convert_565_8888_c;
+}
+
+static EphyrConvertRowProc
+ephyr_convert_find_8_32(void)
+{
+#ifdef EPHYR_CONVERT_X86
+    if (ephyr_convert_have_simd("avx2"))
+        return ephyr_convert_8_32_avx2;
+#endif
+    return ephyr_convert_8_32_c;
+}
+
+/* Combinations with a dedicated converter.  A zero host mask matches any
+ * host visual; only kernels that bypass the lookup table care about the
+ * masks or the byte order.
+ */
+static const struct {
+    int server_depth;
+    int host_bpp;
+    uint32_t red_mask, green_mask, blue_mask;
+    int native_order_only;
+    EphyrConvertRowProc (*find) (void);
+} ephyr_convert_fast_paths[] = {
+    { 16, 32, 0xff0000, 0x00ff00, 0x0000ff, 1, ephyr_convert_find_565_8888 },
+    { 8, 32, 0, 0, 0, 0, ephyr_convert_find_8_32 },
+};
+
+/* Table driven fallbacks, by server and host bits per pixel. */
+static const struct {
+    int server_bpp;
+    int host_bpp;
+    EphyrConvertRowProc row;
+} ephyr_convert_lut_paths[] = {
+    { 8, 16, ephyr_convert_8_16_c },
+    { 8, 24, ephyr_convert_8_24_c },
+    { 8, 32, ephyr_convert_8_32_c },
+    { 16, 16, ephyr_convert_16_16_c },
+    { 16, 24, ephyr_convert_16_24_c },
+    { 16, 32, ephyr_convert_16_32_c },
+    { 32, 16, ephyr_convert_32_16_c },
+    { 32, 24, ephyr_convert_32_24_c },
+    { 32, 32, ephyr_convert_32_32_c },
+};
+
+#define ARRAY_LENGTH(a) (sizeof(a) / sizeof((a)[0]))
+
+static int
+ephyr_mask_shift(uint32_t mask)
+{
+    int shift = 0;
+
+    if (!mask)
+        return 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+static int
+ephyr_mask_width(uint32_t mask)
+{
+    int width = 0;
+
+    for (mask >>= ephyr_mask_shift(mask); mask & 1; mask >>= 1)
+        width++;
+    return width;
+}
+
+/* Scale a channel value between bit widths, replicating its high bits
+ * into the new low bits so that 0 and full intensity are preserved.
+ */
+static uint32_t
+ephyr_scale_channel(uint32_t v, int from_bits, int to_bits)
+{
+    uint32_t out = 0;
+    int filled = 0;
+
+    if (!from_bits || !to_bits)
+        return 0;
+
+    while (filled < to_bits) {
+        out = (out << from_bits) | v;
+        filled += from_bits;
+    }
+    return out >> (filled - to_bits);
+}
+
+/* Lay out a host pixel the way the row converters store it. */
+static uint32_t
+ephyr_convert_host_layout(const EphyrPixelFormat *host, uint32_t pixel)
+{
+    switch (host->bpp) {
+    case 32:
+        if (host->byte_order == EPHYR_NATIVE_ORDER)
+            return pixel;
+        return (pixel >> 24) | ((pixel >> 8) & 0xff00) |
+            ((pixel << 8) & 0xff0000) | (pixel << 24);
+    case 24:
+        if (host->byte_order == XCB_IMAGE_ORDER_LSB_FIRST)
+            return pixel & 0xffffff;
+        return ((pixel & 0xff) << 16) | (pixel & 0xff00) |
+            ((pixel >> 16) & 0xff);
+    case 16:
+        if (host->byte_order == EPHYR_NATIVE_ORDER)
+            return pixel & 0xffff;
+        return ((pixel >> 8) & 0xff) | ((pixel & 0xff) << 8);
+    }
+    return pixel;
+}
+
+/* Host pixel for one server channel value, @c being 0, 1 or 2 for red,
+ * green and blue.
+ */
+static uint32_t
+ephyr_convert_channel(const EphyrConvert *conv, int c, uint32_t v)
+{
+    const uint32_t server_masks[3] = {
+        conv->server.red_mask, conv->server.green_mask, conv->server.blue_mask
+    };
+    const uint32_t host_masks[3] = {
+        conv->host.red_mask, conv->host.green_mask, conv->host.blue_mask
+    };
+
+    return ephyr_scale_channel(v, ephyr_mask_width(server_masks[c]),
+                               ephyr_mask_width(host_masks[c]))
+        << ephyr_mask_shift(host_masks[c]);
+}
+
+static uint32_t *
+ephyr_convert_build_lut(EphyrConvert *conv, const uint32_t *palette)
+{
+    const uint32_t masks[3] = {
+        conv->server.red_mask, conv->server.green_mask, conv->server.blue_mask
+    };
+    uint32_t *lut;
+    uint32_t p, v;
+    int c;
+
+    switch (conv->server.bpp) {
+    case 8:
+        lut = calloc(256, sizeof(uint32_t));
+        if (lut && palette) {
+            for (p = 0; p < 256; p++)
+                lut[p] = ephyr_convert_host_layout(&conv->host, palette[p]);
+        }
+        return lut;
+
+    case 16:
+        lut = malloc(65536 * sizeof(uint32_t));
+        if (!lut)
+            return NULL;
+        for (p = 0; p < 65536; p++) {
+            uint32_t pixel = 0;
+
+            for (c = 0; c < 3; c++)
+                pixel |= ephyr_convert_channel(conv, c, (p & masks[c]) >>
+                                               ephyr_mask_shift(masks[c]));
+            lut[p] = ephyr_convert_host_layout(&conv->host, pixel);
+        }
+        return lut;
+
+    case 32:
+        lut = calloc(3 * EPHYR_CHANNEL_LUT_SIZE, sizeof(uint32_t));
+        if (!lut)
+            return NULL;
+        for (c = 0; c < 3; c++) {
+            conv->channel_shift[c] = ephyr_mask_shift(masks[c]);
+            conv->channel_mask[c] = masks[c] >> conv->channel_shift[c];
+            if (conv->channel_mask[c] >= EPHYR_CHANNEL_LUT_SIZE) {
+                free(lut);
+                return NULL;
+            }
+            /* byte swapping distributes over OR, so the three channel
+             * tables can each hold their part already in host order */
+            for (v = 0; v <= conv->channel_mask[c]; v++)
+                lut[c * EPHYR_CHANNEL_LUT_SIZE + v] =
+                    ephyr_convert_host_layout(&conv->host,
+                                              ephyr_convert_channel(conv, c,
+                                                                    v));
+        }
+        return lut;
+    }
+
+    return NULL;
+}
+
+EphyrConvert *
+ephyr_convert_create(const EphyrPixelFormat *server,
+                     const EphyrPixelFormat *host,
+                     const uint32_t *palette)
+{
+    EphyrConvert *conv;
+    unsigned int i;
+
+    conv = calloc(1, sizeof(EphyrConvert));
+    if (!conv)
+        return NULL;
+    conv->server = *server;
+    conv->host = *host;
+
+    for (i = 0; i < ARRAY_LENGTH(ephyr_convert_lut_paths); i++) {
+        if (ephyr_convert_lut_paths[i].server_bpp == server->bpp &&
+            ephyr_convert_lut_paths[i].host_bpp == host->bpp) {
+            conv->row = ephyr_convert_lut_paths[i].row;
+            break;
+        }
+    }
+
+    if (!conv->row ||
+        (server->depth > 8 &&
+         !(host->red_mask && host->green_mask && host->blue_mask))) {
+        free(conv);
+        return NULL;
+    }
+
+    conv->lut = ephyr_convert_build_lut(conv, palette);
+    if (!conv->lut) {
+        free(conv);
+        return NULL;
+    }
+
+    for (i = 0; i < ARRAY_LENGTH(ephyr_convert_fast_paths); i++) {
+        if (ephyr_convert_fast_paths[i].server_depth != server->depth ||
+            ephyr_convert_fast_paths[i].host_bpp != host->bpp)
+            continue;
+        if (ephyr_convert_fast_paths[i].red_mask &&
+            (ephyr_convert_fast_paths[i].red_mask != host->red_mask ||
+             ephyr_convert_fast_paths[i].green_mask != host->green_mask ||
+             ephyr_convert_fast_paths[i].blue_mask != host->blue_mask))
+            continue;
+        if (ephyr_convert_fast_paths[i].native_order_only &&
+            host->byte_order != EPHYR_NATIVE_ORDER)
+            continue;
+
+        conv->row = ephyr_convert_fast_paths[i].find();
+        break;
+    }
+
+    return conv;
+}
+
+void
+ephyr_convert_destroy(EphyrConvert *conv)
+{
+    if (!conv)
+        return;
+    free(conv->lut);
+    free(conv);
+}
+
+void
+ephyr_convert_set_palette_entry(EphyrConvert *conv, int idx, uint32_t pixel)
+{
+    if (conv->server.bpp != 8 || idx < 0 || idx > 255)
+        return;
+    conv->lut[idx] = ephyr_convert_host_layout(&conv->host, pixel);
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2014 Prefeitura de Mogi das Cruzes, SP, Brazil
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * ephyr_convert.h
+ *
+ * Row converters used when the Xephyr screen depth doesn't match the
+ * host's, without including any server headers.
+ */
+
+#ifndef _EPHYR_CONVERT_H_
+#define _EPHYR_CONVERT_H_
+
+#include <stdint.h>
+
+typedef struct _ephyrPixelFormat {
+    int depth;
+    int bpp;
+    int byte_order;             /* XCB_IMAGE_ORDER_*; server fbs are native */
+    uint32_t red_mask;          /* all masks are 0 for PseudoColor */
+    uint32_t green_mask;
+    uint32_t blue_mask;
+} EphyrPixelFormat;
+
+typedef struct _ephyrConvert EphyrConvert;
+
+/**
+ * Converts @width pixels of one row from the server framebuffer (@src)
+ * into the host image (@dst).
+ */
+typedef void (*EphyrConvertRowProc) (const EphyrConvert *conv,
+                                     uint8_t *dst, const uint8_t *src,
+                                     int width);
+
+struct _ephyrConvert {
+    EphyrConvertRowProc row;
+    EphyrPixelFormat server;
+    EphyrPixelFormat host;
+
+    /* Host pixels, already laid out the way they are stored in the host
+     * image.  Indexed by the server pixel for 8, 15 and 16 bit servers,
+     * or by each channel of 24 and 30 bit servers (red, green and blue
+     * tables, one after the other).
+     */
+    uint32_t *lut;
+    int channel_shift[3];
+    uint32_t channel_mask[3];
+};
+
+/**
+ * Build the fastest converter from @server to @host, or return NULL if
+ * the host image layout isn't one X11 allows for a TrueColor visual.
+ * @palette gives the host pixels for 8 bit servers.
+ */
+EphyrConvert *
+ephyr_convert_create(const EphyrPixelFormat *server,
+                     const EphyrPixelFormat *host,
+                     const uint32_t *palette);
+
+void
+ephyr_convert_destroy(EphyrConvert *conv);
+
+/**
+ * Update one entry of an 8 bit server's palette; @pixel is a host pixel.
+ */
+void
+ephyr_convert_set_palette_entry(EphyrConvert *conv, int idx, uint32_t pixel);
+
+#endif /* _EPHYR_CONVERT_H_ */
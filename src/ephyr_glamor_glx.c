@@ -28,6 +28,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <X11/Xlib.h>
 #include <X11/Xlibint.h>
 #undef Xcalloc
@@ -47,19 +48,44 @@
  *
  * Xephyr can render with multiple windows, but all the windows have
  * to be on the same X connection and all have to have the same
- * visual.
+ * visual.  That lets every screen draw with the one context, so that
+ * moving between screens only means binding another window.
  */
 static Display *dpy;
 static XVisualInfo *visual_info;
 static GLXFBConfig fb_config;
+static GLXContext ctx;
+static int glx_event_base;
 Bool ephyr_glamor_gles2;
+/** Host vblanks per frame, -1 for adaptive (-swap-interval) */
+int ephyr_glamor_swap_interval = 1;
 /** @} */
 
+/** How a frame gets from the back buffer to the window */
+enum ephyr_glamor_present {
+    /** redraw everything and swap */
+    EPHYR_GLAMOR_PRESENT_FULL,
+    /** GLX_EXT_buffer_age: redraw what changed since the back buffer
+     * was last shown, and swap */
+    EPHYR_GLAMOR_PRESENT_AGE,
+    /** GLX_MESA_copy_sub_buffer: redraw the damage and copy just that */
+    EPHYR_GLAMOR_PRESENT_COPY,
+};
+
+/** Frames of damage kept for GLX_EXT_buffer_age */
+#define EPHYR_GLAMOR_DAMAGE_HISTORY 4
+
+/** Past this many boxes, copy-sub-buffer copies their extents instead */
+#define EPHYR_GLAMOR_MAX_COPIES 16
+
+#ifndef GLX_BufferSwapComplete
+#define GLX_BufferSwapComplete 1
+#endif
+
 /**
  * Per-screen state for Xephyr with glamor.
  */
 struct ephyr_glamor {
-    GLXContext ctx;
     Window win;
     GLXWindow glx_win;
 
@@ -69,10 +95,51 @@ struct ephyr_glamor {
     GLuint texture_shader_position_loc;
     GLuint texture_shader_texcoord_loc;
 
+    /* Interleaved position/texcoord vertices: the full screen quad, built
+     * once, and the damaged boxes of the last partial redraw.  The vertex
+     * array objects are 0 when the GL has none.
+     */
+    GLuint quad_vbo, quad_vao;
+    GLuint box_vbo, box_vao;
+    GLsizeiptr box_vbo_size;
+    float *box_verts;
+    size_t box_verts_size;
+
     /* Size of the window that we're rendering to. */
     unsigned width, height;
+
+    enum ephyr_glamor_present present;
+    /* Damage of the last frames, newest first (buffer age) */
+    pixman_region16_t history[EPHYR_GLAMOR_DAMAGE_HISTORY];
+    int n_history;
+    /* The back buffer holds the last frame (copy-sub-buffer) */
+    Bool back_valid;
+
+    /* GLX_INTEL_swap_event tells us when a swap has completed, so that
+     * we keep at most one in flight instead of blocking in the next one.
+     */
+    Bool swap_events;
+    Bool swap_pending;
+    CARD32 swap_time;           /* when the pending swap was queued */
+
+    struct ephyr_glamor *next;
 };
 
+/** All the screens, for routing swap completions */
+static struct ephyr_glamor *glamor_screens;
+
+/* Note the types on wire_to_event: there's an Xlib XEvent (with the
+ * broken types) that it returns, and a protocol xEvent that it inspects.
+ */
+typedef Bool (*ephyr_glamor_wire_to_event)(Display *dpy, XEvent *ret,
+                                           xEvent *event);
+
+/**
+ * Xlib's wire-to-event hooks that do more than Xlib's own conversion,
+ * by event type: what GLX and DRI2 registered, NULL for everything else.
+ */
+static ephyr_glamor_wire_to_event wire_to_event_hooks[128];
+
 static GLint
 ephyr_glamor_compile_glsl_prog(GLenum type, const char *source)
 {
@@ -131,6 +198,58 @@ ephyr_glamor_build_glsl_prog(GLuint vs, GLuint fs)
     return prog;
 }
 
+/* Point the texturing shader at the interleaved vertices in @vbo */
+static void
+ephyr_glamor_setup_attribs(struct ephyr_glamor *glamor, GLuint vbo)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glVertexAttribPointer(glamor->texture_shader_position_loc,
+                          2, GL_FLOAT, FALSE, 4 * sizeof(float), (void *) 0);
+    glVertexAttribPointer(glamor->texture_shader_texcoord_loc,
+                          2, GL_FLOAT, FALSE, 4 * sizeof(float),
+                          (void *) (2 * sizeof(float)));
+    glEnableVertexAttribArray(glamor->texture_shader_position_loc);
+    glEnableVertexAttribArray(glamor->texture_shader_texcoord_loc);
+}
+
+static void
+ephyr_glamor_setup_vertices(struct ephyr_glamor *glamor)
+{
+    static const float quad[] = {
+        /* position  texcoord */
+        -1, -1,      0, 1,
+         1, -1,      1, 1,
+         1,  1,      1, 0,
+        -1,  1,      0, 0,
+    };
+
+    glGenBuffers(1, &glamor->quad_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, glamor->quad_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+    glGenBuffers(1, &glamor->box_vbo);
+
+    if (epoxy_gl_version() >= 30 ||
+        epoxy_has_gl_extension("GL_ARB_vertex_array_object") ||
+        epoxy_has_gl_extension("GL_OES_vertex_array_object")) {
+        GLint old_vao;
+
+        /* glamor shares the context and has no idea about these */
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &old_vao);
+
+        glGenVertexArrays(1, &glamor->quad_vao);
+        glBindVertexArray(glamor->quad_vao);
+        ephyr_glamor_setup_attribs(glamor, glamor->quad_vbo);
+
+        glGenVertexArrays(1, &glamor->box_vao);
+        glBindVertexArray(glamor->box_vao);
+        ephyr_glamor_setup_attribs(glamor, glamor->box_vbo);
+
+        glBindVertexArray(old_vao);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 static void
 ephyr_glamor_setup_texturing_shader(struct ephyr_glamor *glamor)
 {
@@ -169,6 +288,8 @@ ephyr_glamor_setup_texturing_shader(struct ephyr_glamor *glamor)
     assert(glamor->texture_shader_position_loc != -1);
     glamor->texture_shader_texcoord_loc = glGetAttribLocation(prog, "texcoord");
     assert(glamor->texture_shader_texcoord_loc != -1);
+
+    ephyr_glamor_setup_vertices(glamor);
 }
 
 xcb_connection_t *
@@ -189,47 +310,272 @@ ephyr_glamor_set_texture(struct ephyr_glamor *glamor, uint32_t tex)
     glamor->tex = tex;
 }
 
+/**
+ * Bind the context to the screen's window, unless it already is: glamor
+ * renders to textures and leaves whichever window it found bound.
+ */
+static void
+ephyr_glamor_make_current(struct ephyr_glamor *glamor)
+{
+    if (glXGetCurrentContext() == ctx &&
+        glXGetCurrentDrawable() == glamor->glx_win)
+        return;
+
+    if (!glXMakeCurrent(dpy, glamor->glx_win, ctx))
+        FatalError("glXMakeCurrent failed\n");
+}
+
+/* Draw @count vertices of @vao, or of @vbo where there are no VAOs */
+static void
+ephyr_glamor_draw(struct ephyr_glamor *glamor, GLuint vao, GLuint vbo,
+                  GLenum mode, int count)
+{
+    GLint old_vao = 0;
+
+    /* Put back whatever glamor had bound in the shared context */
+    if (vao) {
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &old_vao);
+        glBindVertexArray(vao);
+    }
+    else
+        ephyr_glamor_setup_attribs(glamor, vbo);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, glamor->tex);
+    glDrawArrays(mode, 0, count);
+
+    if (vao)
+        glBindVertexArray(old_vao);
+    else {
+        glDisableVertexAttribArray(glamor->texture_shader_position_loc);
+        glDisableVertexAttribArray(glamor->texture_shader_texcoord_loc);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
+
+/**
+ * Draw the boxes of the screen texture into the same place in the back
+ * buffer.
+ */
+static void
+ephyr_glamor_draw_boxes(struct ephyr_glamor *glamor,
+                        const pixman_box16_t *boxes, int nbox)
+{
+    size_t size = nbox * 6 * 4 * sizeof(float);
+    float *v;
+    int i;
+
+    if (size > glamor->box_verts_size) {
+        float *verts = realloc(glamor->box_verts, size);
+
+        /* Out of memory: the whole screen will do */
+        if (!verts) {
+            ephyr_glamor_draw(glamor, glamor->quad_vao, glamor->quad_vbo,
+                              GL_TRIANGLE_FAN, 4);
+            return;
+        }
+        glamor->box_verts = verts;
+        glamor->box_verts_size = size;
+    }
+
+    /* Two triangles per box, each vertex a position and a texcoord */
+    for (i = 0, v = glamor->box_verts; i < nbox; i++) {
+        float u1 = (float) boxes[i].x1 / glamor->width;
+        float u2 = (float) boxes[i].x2 / glamor->width;
+        float v1 = (float) boxes[i].y1 / glamor->height;
+        float v2 = (float) boxes[i].y2 / glamor->height;
+        const float corners[6][2] = {
+            { u1, v1 }, { u2, v1 }, { u2, v2 },
+            { u1, v1 }, { u2, v2 }, { u1, v2 },
+        };
+        int c;
+
+        for (c = 0; c < 6; c++) {
+            *v++ = corners[c][0] * 2 - 1;
+            *v++ = 1 - corners[c][1] * 2;
+            *v++ = corners[c][0];
+            *v++ = corners[c][1];
+        }
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, glamor->box_vbo);
+    if (size > glamor->box_vbo_size) {
+        glBufferData(GL_ARRAY_BUFFER, size, glamor->box_verts,
+                     GL_STREAM_DRAW);
+        glamor->box_vbo_size = size;
+    }
+    else
+        glBufferSubData(GL_ARRAY_BUFFER, 0, size, glamor->box_verts);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    ephyr_glamor_draw(glamor, glamor->box_vao, glamor->box_vbo,
+                      GL_TRIANGLES, nbox * 6);
+}
+
+static void
+ephyr_glamor_clear_history(struct ephyr_glamor *glamor)
+{
+    while (glamor->n_history)
+        pixman_region_fini(&glamor->history[--glamor->n_history]);
+    glamor->back_valid = FALSE;
+}
+
+static void
+ephyr_glamor_push_history(struct ephyr_glamor *glamor,
+                          struct pixman_region16 *damage)
+{
+    if (glamor->n_history == EPHYR_GLAMOR_DAMAGE_HISTORY)
+        pixman_region_fini(&glamor->history[--glamor->n_history]);
+    memmove(&glamor->history[1], &glamor->history[0],
+            glamor->n_history * sizeof(glamor->history[0]));
+    pixman_region_init(&glamor->history[0]);
+    pixman_region_copy(&glamor->history[0], damage);
+    glamor->n_history++;
+}
+
 void
 ephyr_glamor_damage_redisplay(struct ephyr_glamor *glamor,
                               struct pixman_region16 *damage)
 {
-    /* Redraw the whole screen, since glXSwapBuffers leaves the back
-     * buffer undefined.
+    pixman_region16_t redraw;
+    pixman_box16_t *boxes;
+    unsigned int age = 0;
+    Bool partial;
+    int i, nbox;
+
+    ephyr_glamor_make_current(glamor);
+
+    /* glXSwapBuffers leaves the back buffer undefined, unless buffer
+     * age says which old frame it holds.
      */
-    static const float position[] = {
-        -1, -1,
-         1, -1,
-         1,  1,
-        -1,  1,
-    };
-    static const float texcoords[] = {
-        0, 1,
-        1, 1,
-        1, 0,
-        0, 0,
-    };
+    switch (glamor->present) {
+    case EPHYR_GLAMOR_PRESENT_AGE:
+        glXQueryDrawable(dpy, glamor->glx_win, GLX_BACK_BUFFER_AGE_EXT, &age);
+        partial = age > 0 && age <= glamor->n_history + 1;
+        break;
+    case EPHYR_GLAMOR_PRESENT_COPY:
+        partial = glamor->back_valid;
+        break;
+    default:
+        partial = FALSE;
+        break;
+    }
+
+    pixman_region_init_rect(&redraw, 0, 0, glamor->width, glamor->height);
+    if (partial) {
+        pixman_region16_t changed;
+
+        pixman_region_init(&changed);
+        pixman_region_copy(&changed, damage);
+        for (i = 0; i < (int) age - 1; i++)
+            pixman_region_union(&changed, &changed, &glamor->history[i]);
+        pixman_region_intersect(&redraw, &redraw, &changed);
+        pixman_region_fini(&changed);
+    }
 
-    glXMakeCurrent(dpy, glamor->glx_win, glamor->ctx);
+    boxes = pixman_region_rectangles(&redraw, &nbox);
+    if (!nbox) {
+        pixman_region_fini(&redraw);
+        return;
+    }
 
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
     glUseProgram(glamor->texture_shader);
     glViewport(0, 0, glamor->width, glamor->height);
+    if (partial)
+        ephyr_glamor_draw_boxes(glamor, boxes, nbox);
+    else
+        ephyr_glamor_draw(glamor, glamor->quad_vao, glamor->quad_vbo,
+                          GL_TRIANGLE_FAN, 4);
+
+    if (glamor->present == EPHYR_GLAMOR_PRESENT_COPY) {
+        pixman_box16_t *extents = pixman_region_extents(&redraw);
+
+        if (nbox > EPHYR_GLAMOR_MAX_COPIES) {
+            boxes = extents;
+            nbox = 1;
+        }
+        /* GL windows count rows from the bottom */
+        for (i = 0; i < nbox; i++)
+            glXCopySubBufferMESA(dpy, glamor->glx_win,
+                                 boxes[i].x1, glamor->height - boxes[i].y2,
+                                 boxes[i].x2 - boxes[i].x1,
+                                 boxes[i].y2 - boxes[i].y1);
+        glamor->back_valid = TRUE;
+    }
+    else {
+        if (glamor->present == EPHYR_GLAMOR_PRESENT_AGE)
+            ephyr_glamor_push_history(glamor, damage);
+        glXSwapBuffers(dpy, glamor->glx_win);
+        if (glamor->swap_events) {
+            glamor->swap_pending = TRUE;
+            glamor->swap_time = GetTimeInMillis();
+        }
+    }
 
-    glVertexAttribPointer(glamor->texture_shader_position_loc,
-                          2, GL_FLOAT, FALSE, 0, position);
-    glVertexAttribPointer(glamor->texture_shader_texcoord_loc,
-                          2, GL_FLOAT, FALSE, 0, texcoords);
-    glEnableVertexAttribArray(glamor->texture_shader_position_loc);
-    glEnableVertexAttribArray(glamor->texture_shader_texcoord_loc);
+    pixman_region_fini(&redraw);
+}
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, glamor->tex);
-    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+/**
+ * Whether the screen's last swap hasn't completed yet, so that painting
+ * now would queue a second frame behind it.  A completion the host never
+ * sends only holds frames back for EPHYR_GLAMOR_SWAP_TIMEOUT.
+ */
+Bool
+ephyr_glamor_swap_pending(struct ephyr_glamor *glamor)
+{
+    if (!glamor || !glamor->swap_pending)
+        return FALSE;
 
-    glDisableVertexAttribArray(glamor->texture_shader_position_loc);
-    glDisableVertexAttribArray(glamor->texture_shader_texcoord_loc);
+    if ((CARD32) (GetTimeInMillis() - glamor->swap_time) >=
+        EPHYR_GLAMOR_SWAP_TIMEOUT)
+        glamor->swap_pending = FALSE;
 
-    glXSwapBuffers(dpy, glamor->glx_win);
+    return glamor->swap_pending;
+}
+
+/* Mark the swap of the screen drawing to @drawable as completed */
+static xcb_window_t
+ephyr_glamor_swap_complete(GLXDrawable drawable)
+{
+    struct ephyr_glamor *glamor;
+
+    for (glamor = glamor_screens; glamor; glamor = glamor->next) {
+        if (glamor->glx_win == drawable || glamor->win == drawable) {
+            glamor->swap_pending = FALSE;
+            return glamor->win;
+        }
+    }
+
+    return XCB_WINDOW_NONE;
+}
+
+/**
+ * Take a fresh copy of the wire-to-event hooks, after something (GLX and
+ * DRI2 initialization, that is) may have registered new ones.
+ */
+static void
+ephyr_glamor_refresh_hooks(void)
+{
+    int type;
+
+    XLockDisplay(dpy);
+    for (type = KeyPress; type < (int) ARRAY_SIZE(wire_to_event_hooks);
+         type++) {
+        ephyr_glamor_wire_to_event wire_to_event;
+
+        /* Set the event handler to NULL to get access to the current
+         * one, and plug it back in.
+         */
+        wire_to_event = XESetWireToEvent(dpy, type, NULL);
+        XESetWireToEvent(dpy, type, wire_to_event);
+
+        if (wire_to_event == _XUnknownWireEvent ||
+            wire_to_event == _XWireToEvent)
+            wire_to_event = NULL;
+        wire_to_event_hooks[type] = wire_to_event;
+    }
+    XUnlockDisplay(dpy);
 }
 
 /**
@@ -238,49 +584,65 @@ ephyr_glamor_damage_redisplay(struct ephyr_glamor *glamor,
  * We need to let the Xlib event filtering run on the event so that
  * Mesa's dri2_glx.c userspace event mangling gets run, and we
  * correctly get our invalidate events propagated into the driver.
+ * Events nobody hooked (input, mostly) go by without touching Xlib.
+ *
+ * Returns the host window of the screen whose swap the event completed,
+ * or XCB_WINDOW_NONE.
  */
-void
+xcb_window_t
 ephyr_glamor_process_event(xcb_generic_event_t *xev)
 {
+    ephyr_glamor_wire_to_event wire_to_event =
+        wire_to_event_hooks[xev->response_type & 0x7f];
+    xcb_window_t completed = XCB_WINDOW_NONE;
+    XEvent processed_event;
 
-    uint32_t response_type = xev->response_type & 0x7f;
-    /* Note the types on wire_to_event: there's an Xlib XEvent (with
-     * the broken types) that it returns, and a protocol xEvent that
-     * it inspects.
-     */
-    Bool (*wire_to_event)(Display *dpy, XEvent *ret, xEvent *event);
+    if (!wire_to_event)
+        return XCB_WINDOW_NONE;
 
     XLockDisplay(dpy);
-    /* Set the event handler to NULL to get access to the current one. */
-    wire_to_event = XESetWireToEvent(dpy, response_type, NULL);
-    if (wire_to_event) {
-        XEvent processed_event;
+    xev->sequence = LastKnownRequestProcessed(dpy);
+    if (wire_to_event(dpy, &processed_event, (xEvent *)xev) &&
+        processed_event.type == glx_event_base + GLX_BufferSwapComplete) {
+        GLXBufferSwapComplete *swap =
+            (GLXBufferSwapComplete *) &processed_event;
 
-        /* OK they had an event handler.  Plug it back in, and call
-         * through to it.
-         */
-        XESetWireToEvent(dpy, response_type, wire_to_event);
-        xev->sequence = LastKnownRequestProcessed(dpy);
-        wire_to_event(dpy, &processed_event, (xEvent *)xev);
+        completed = ephyr_glamor_swap_complete(swap->drawable);
     }
     XUnlockDisplay(dpy);
+
+    return completed;
 }
 
-struct ephyr_glamor *
-ephyr_glamor_glx_screen_init(xcb_window_t win)
+/* Apply -swap-interval to the current drawable */
+static void
+ephyr_glamor_set_swap_interval(struct ephyr_glamor *glamor)
 {
-    GLXContext ctx;
-    struct ephyr_glamor *glamor;
-    GLXWindow glx_win;
-
-    glamor = calloc(1, sizeof(struct ephyr_glamor));
-    if (!glamor) {
-        FatalError("malloc");
-        return NULL;
+    int screen = DefaultScreen(dpy);
+    int interval = ephyr_glamor_swap_interval;
+
+    if (epoxy_has_glx_extension(dpy, screen, "GLX_EXT_swap_control")) {
+        if (interval < 0 &&
+            !epoxy_has_glx_extension(dpy, screen,
+                                     "GLX_EXT_swap_control_tear")) {
+            ErrorF("Xephyr: no adaptive vsync on the host, using 1\n");
+            interval = 1;
+        }
+        glXSwapIntervalEXT(dpy, glamor->glx_win, interval);
     }
+    else if (interval >= 0 &&
+             epoxy_has_glx_extension(dpy, screen, "GLX_MESA_swap_control")) {
+        glXSwapIntervalMESA(interval);
+    }
+    else if (interval != 1) {
+        ErrorF("Xephyr: the host can't set swap interval %d\n", interval);
+    }
+}
 
-    glx_win = glXCreateWindow(dpy, fb_config, win, NULL);
-
+/* Make the context all the screens share, along with the first of them */
+static void
+ephyr_glamor_create_context(void)
+{
     if (ephyr_glamor_gles2) {
         static const int context_attribs[] = {
             GLX_CONTEXT_MAJOR_VERSION_ARB, 2,
@@ -301,14 +663,53 @@ ephyr_glamor_glx_screen_init(xcb_window_t win)
     }
     if (ctx == NULL)
         FatalError("glXCreateContext failed\n");
+}
 
-    if (!glXMakeCurrent(dpy, glx_win, ctx))
-        FatalError("glXMakeCurrent failed\n");
+struct ephyr_glamor *
+ephyr_glamor_glx_screen_init(xcb_window_t win)
+{
+    struct ephyr_glamor *glamor;
+    GLXWindow glx_win;
+
+    glamor = calloc(1, sizeof(struct ephyr_glamor));
+    if (!glamor) {
+        FatalError("malloc");
+        return NULL;
+    }
+
+    glx_win = glXCreateWindow(dpy, fb_config, win, NULL);
+
+    if (!ctx)
+        ephyr_glamor_create_context();
 
-    glamor->ctx = ctx;
     glamor->win = win;
     glamor->glx_win = glx_win;
+    ephyr_glamor_make_current(glamor);
     ephyr_glamor_setup_texturing_shader(glamor);
+    ephyr_glamor_set_swap_interval(glamor);
+
+    if (epoxy_has_glx_extension(dpy, DefaultScreen(dpy),
+                                "GLX_EXT_buffer_age"))
+        glamor->present = EPHYR_GLAMOR_PRESENT_AGE;
+    else if (epoxy_has_glx_extension(dpy, DefaultScreen(dpy),
+                                     "GLX_MESA_copy_sub_buffer"))
+        glamor->present = EPHYR_GLAMOR_PRESENT_COPY;
+    else
+        glamor->present = EPHYR_GLAMOR_PRESENT_FULL;
+
+    /* copy-sub-buffer presents synchronously, and sends no events */
+    if (glamor->present != EPHYR_GLAMOR_PRESENT_COPY &&
+        epoxy_has_glx_extension(dpy, DefaultScreen(dpy),
+                                "GLX_INTEL_swap_event")) {
+        glXSelectEvent(dpy, glx_win, GLX_BUFFER_SWAP_COMPLETE_INTEL_MASK);
+        glamor->swap_events = TRUE;
+    }
+
+    /* DRI2 hooks its events in as the context gets bound to a window */
+    ephyr_glamor_refresh_hooks();
+
+    glamor->next = glamor_screens;
+    glamor_screens = glamor;
 
     return glamor;
 }
@@ -316,10 +717,38 @@ ephyr_glamor_glx_screen_init(xcb_window_t win)
 void
 ephyr_glamor_glx_screen_fini(struct ephyr_glamor *glamor)
 {
-    glXMakeCurrent(dpy, None, NULL);
-    glXDestroyContext(dpy, glamor->ctx);
+    struct ephyr_glamor **prev;
+
+    for (prev = &glamor_screens; *prev; prev = &(*prev)->next) {
+        if (*prev == glamor) {
+            *prev = glamor->next;
+            break;
+        }
+    }
+
+    ephyr_glamor_make_current(glamor);
+    if (glamor->quad_vao) {
+        glDeleteVertexArrays(1, &glamor->quad_vao);
+        glDeleteVertexArrays(1, &glamor->box_vao);
+    }
+    glDeleteBuffers(1, &glamor->quad_vbo);
+    glDeleteBuffers(1, &glamor->box_vbo);
+
+    /* Screens still around keep the context, and glamor may go on using
+     * it without rebinding: leave it bound to one of their windows.
+     */
+    if (glamor_screens) {
+        ephyr_glamor_make_current(glamor_screens);
+    }
+    else {
+        glXMakeCurrent(dpy, None, NULL);
+        glXDestroyContext(dpy, ctx);
+        ctx = NULL;
+    }
     glXDestroyWindow(dpy, glamor->glx_win);
 
+    ephyr_glamor_clear_history(glamor);
+    free(glamor->box_verts);
     free(glamor);
 }
 
@@ -337,10 +766,10 @@ ephyr_glamor_get_visual(void)
         GLX_DOUBLEBUFFER, 1,
         None
     };
-    int event_base = 0, error_base = 0, nelements;
+    int error_base = 0, nelements;
     GLXFBConfig *fbconfigs;
 
-    if (!glXQueryExtension (dpy, &error_base, &event_base))
+    if (!glXQueryExtension (dpy, &error_base, &glx_event_base))
         FatalError("Couldn't find GLX extension\n");
 
     fbconfigs = glXChooseFBConfig(dpy, DefaultScreen(dpy), attribs, &nelements);
@@ -353,6 +782,9 @@ ephyr_glamor_get_visual(void)
     if (visual_info == NULL)
         FatalError("Couldn't get RGB visual\n");
 
+    /* GLX has hooked its events in by now */
+    ephyr_glamor_refresh_hooks();
+
     return xcb_aux_find_visual_by_id(xscreen, visual_info->visualid);
 }
 
@@ -363,6 +795,10 @@ ephyr_glamor_set_window_size(struct ephyr_glamor *glamor,
     if (!glamor)
         return;
 
+    /* the old back buffer contents don't fit the new size */
+    if (glamor->width != width || glamor->height != height)
+        ephyr_glamor_clear_history(glamor);
+
     glamor->width = width;
     glamor->height = height;
 }
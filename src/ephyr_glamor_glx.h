@@ -34,6 +34,9 @@
 struct ephyr_glamor;
 struct pixman_region16;
 
+/** Longest a frame waits for the host to complete the previous swap, ms */
+#define EPHYR_GLAMOR_SWAP_TIMEOUT 100
+
 xcb_connection_t *
 ephyr_glamor_connect(void);
 
@@ -58,7 +61,10 @@ void
 ephyr_glamor_damage_redisplay(struct ephyr_glamor *glamor,
                               struct pixman_region16 *damage);
 
-void
+Bool
+ephyr_glamor_swap_pending(struct ephyr_glamor *glamor);
+
+xcb_window_t
 ephyr_glamor_process_event(xcb_generic_event_t *xev);
 
 #else /* !GLAMOR */
@@ -75,9 +81,16 @@ ephyr_glamor_damage_redisplay(struct ephyr_glamor *glamor,
 {
 }
 
-static inline void
+static inline Bool
+ephyr_glamor_swap_pending(struct ephyr_glamor *glamor)
+{
+    return FALSE;
+}
+
+static inline xcb_window_t
 ephyr_glamor_process_event(xcb_generic_event_t *xev)
 {
+    return XCB_WINDOW_NONE;
 }
 
 #endif /* !GLAMOR */
@@ -33,14 +33,17 @@
 extern Window EphyrPreExistingHostWin;
 extern Bool EphyrWantGrayScale;
 extern Bool EphyrWantResize;
+extern int ephyrRedisplayInterval;
 extern Bool kdHasPointer;
 extern Bool kdHasKbd;
 extern Bool ephyr_glamor, ephyr_glamor_gles2;
+extern int ephyr_glamor_swap_interval;
 
 #ifdef GLXEXT
 extern Bool ephyrNoDRI;
 #endif
 extern Bool ephyrNoXV;
+extern Bool ephyrNoInputThread;
 
 #ifdef KDRIVE_EVDEV
 extern KdPointerDriver LinuxEvdevMouseDriver;
@@ -139,9 +142,14 @@ ddxUseMsg(void)
     ErrorF("-output <NAME>       Attempt to run Xephyr fullscreen (restricted to given output geometry)\n");
     ErrorF("-grayscale           Simulate 8bit grayscale\n");
     ErrorF("-resizeable          Make Xephyr windows resizeable\n");
+    ErrorF("-shm-buffers <n>     Paint through n (1-3) host SHM segments per screen\n");
+    ErrorF("-box-cost <shm>,<put> Pixels worth one more put when merging damage boxes\n");
+    ErrorF("-fps <n>             Paint at most n frames per second (default %d, 0 for no limit)\n",
+           EPHYR_DEFAULT_FPS);
 #ifdef GLAMOR
     ErrorF("-glamor              Enable 2D acceleration using glamor\n");
     ErrorF("-glamor_gles2        Enable 2D acceleration using glamor (with GLES2 only)\n");
+    ErrorF("-swap-interval <n>   Host vblanks per glamor frame (0, 1, -1 for adaptive; default 1)\n");
 #endif
     ErrorF
         ("-fakexa              Simulate acceleration using software rendering\n");
@@ -150,6 +158,7 @@ ddxUseMsg(void)
     ErrorF("-nodri               do not use DRI\n");
 #endif
     ErrorF("-noxv                do not use XV\n");
+    ErrorF("-noinputthread       read host events on the main thread\n");
     ErrorF("-name [name]         define the name in the WM_CLASS property\n");
     ErrorF
         ("-title [title]       set the window title in the WM_NAME property\n");
@@ -270,6 +279,50 @@ ddxProcessArgument(int argc, char **argv, int i)
         EphyrWantResize = 1;
         return 1;
     }
+    else if (!strcmp(argv[i], "-shm-buffers")) {
+        if (i + 1 < argc && argv[i + 1][0] != '-') {
+            int n = atoi(argv[i + 1]);
+
+            if (n >= 1 && n <= EPHYR_MAX_HOST_IMAGES) {
+                hostx_use_shm_buffers(n);
+                return 2;
+            }
+        }
+
+        UseMsg();
+        exit(1);
+    }
+    else if (!strcmp(argv[i], "-fps")) {
+        if (i + 1 < argc && argv[i + 1][0] != '-') {
+            int fps = atoi(argv[i + 1]);
+
+            if (fps > 1000) {
+                ErrorF("Xephyr: -fps %d is more than the millisecond timer "
+                       "can pace, using 1000\n", fps);
+                fps = 1000;
+            }
+            if (fps >= 0) {
+                ephyrRedisplayInterval = fps ? 1000 / fps : 0;
+                return 2;
+            }
+        }
+
+        UseMsg();
+        exit(1);
+    }
+    else if (!strcmp(argv[i], "-box-cost")) {
+        int shm, put;
+
+        if (i + 1 < argc &&
+            sscanf(argv[i + 1], "%d,%d", &shm, &put) == 2 &&
+            shm >= 0 && put >= 0) {
+            hostx_set_box_cost(shm, put);
+            return 2;
+        }
+
+        UseMsg();
+        exit(1);
+    }
 #ifdef GLAMOR
     else if (!strcmp (argv[i], "-glamor")) {
         ephyr_glamor = TRUE;
@@ -288,6 +341,20 @@ ddxProcessArgument(int argc, char **argv, int i)
         ephyrFuncs.finiAccel = ephyr_glamor_fini;
         return 1;
     }
+    else if (!strcmp(argv[i], "-swap-interval")) {
+        if (i + 1 < argc &&
+            (argv[i + 1][0] != '-' || !strcmp(argv[i + 1], "-1"))) {
+            int interval = atoi(argv[i + 1]);
+
+            if (interval >= -1 && interval <= 1) {
+                ephyr_glamor_swap_interval = interval;
+                return 2;
+            }
+        }
+
+        UseMsg();
+        exit(1);
+    }
 #endif
     else if (!strcmp(argv[i], "-fakexa")) {
         ephyrFuncs.initAccel = ephyrDrawInit;
@@ -316,6 +383,11 @@ ddxProcessArgument(int argc, char **argv, int i)
         return 1;
     }
 #endif
+    else if (!strcmp(argv[i], "-noinputthread")) {
+        ephyrNoInputThread = TRUE;
+        EPHYR_LOG("no input thread\n");
+        return 1;
+    }
     else if (!strcmp(argv[i], "-noxv")) {
         ephyrNoXV = TRUE;
         EPHYR_LOG("no XVideo enabled\n");
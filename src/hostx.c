@@ -40,7 +40,11 @@
 
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include <X11/keysym.h>
 #include <xcb/xcb.h>
@@ -52,6 +56,8 @@
 #include <xcb/shape.h>
 #include <xcb/xcb_keysyms.h>
 #include <xcb/randr.h>
+#include <xcb/xinput.h>
+#include <xcb/xkb.h>
 #ifdef XF86DRI
 #include <xcb/xf86dri.h>
 #include <xcb/glx.h>
@@ -63,6 +69,21 @@
 #endif
 #include "ephyrlog.h"
 #include "ephyr.h"
+#include "ephyr_convert.h"
+
+/* memfd segments passed with ShmAttachFd, from MIT-SHM 1.2 */
+#if defined(XCB_SHM_ATTACH_FD) && defined(SYS_memfd_create)
+#define EPHYR_SHM_FD 1
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#endif
+
+/* One slot of the host window table; win is XCB_WINDOW_NONE if free */
+typedef struct {
+    xcb_window_t win;
+    KdScreenInfo *screen;
+} EphyrHostWindow;
 
 struct EphyrHostXVars {
     char *server_dpy_name;
@@ -77,13 +98,37 @@ struct EphyrHostXVars {
     Bool use_sw_cursor;
     Bool use_fullscreen;
     Bool have_shm;
+    Bool have_shm_fd;           /* host takes memfd segments */
+    Bool have_shm_sysv;         /* host can attach our SysV segments */
+    uint8_t shm_first_event;
+    int n_shm_buffers;
+    uint8_t xi_opcode;          /* 0 unless the host has XI 2.2 */
+    uint8_t xkb_first_event;    /* 0 unless we speak XKB to the host */
+
+    /* Pixels an extra put is worth, per transport, when deciding whether
+     * to merge two damage boxes: see hostx_paint_region() */
+    Bool box_cost_set;
+    int box_cost_shm;
+    int box_cost_put;
+
+    /* rows of a sub-image being sent with plain PutImage */
+    uint8_t *put_buf;
+    size_t put_buf_size;
 
     int n_screens;
     KdScreenInfo **screens;
 
+    /* open addressed hash of every host window events can come from */
+    EphyrHostWindow *windows;
+    int windows_bits;
+    int n_windows;
+
     long damage_debug_msec;
 
-    unsigned long cmap[256];
+    uint32_t cmap[256];
+
+    /* modifiers each host keycode is bound to, as XCB_MOD_MASK_* bits */
+    uint8_t key_modifiers[256];
 };
 
 /* memset ( missing> ) instead of below  */
@@ -106,6 +151,27 @@ static void
 
 #define host_depth_matches_server(_vars) (HostX.depth == (_vars)->server_depth)
 
+/* Default cost of one more put, in pixels.  A ShmPutImage costs the host
+ * a request and a blit setup, but its pixels are just copied out of the
+ * segment; a PutImage has to carry every pixel through the socket, so a
+ * request is worth far fewer of them.
+ */
+#define EPHYR_BOX_COST_SHM 4096
+#define EPHYR_BOX_COST_PUT 256
+
+/* Bits per pixel of the private framebuffer of a screen whose depth
+ * differs from the host's; matches what ephyrScreenInitialize() picks.
+ */
+static int
+hostx_server_bpp(int depth)
+{
+    if (depth <= 8)
+        return 8;
+    if (depth <= 16)
+        return 16;
+    return 32;
+}
+
 int
 hostx_want_screen_geometry(KdScreenInfo *screen, int *width, int *height, int *x, int *y)
 {
@@ -141,6 +207,117 @@ hostx_add_screen(KdScreenInfo *screen, unsigned long win_id, int screen_num, Boo
     scrpriv->output = output;
 }
 
+static unsigned int
+hostx_window_hash(xcb_window_t win)
+{
+    return (win * 2654435761u) >> (32 - HostX.windows_bits);
+}
+
+static void
+hostx_insert_window(xcb_window_t win, KdScreenInfo *screen)
+{
+    unsigned int mask = (1u << HostX.windows_bits) - 1;
+    unsigned int i;
+
+    for (i = hostx_window_hash(win); HostX.windows[i].win; i = (i + 1) & mask) {
+        if (HostX.windows[i].win == win)
+            break;
+    }
+    if (!HostX.windows[i].win)
+        HostX.n_windows++;
+    HostX.windows[i].win = win;
+    HostX.windows[i].screen = screen;
+}
+
+/*
+ * Remember that events for host window @win belong to @screen.  The
+ * table is kept at most half full so probes stay short.
+ */
+static void
+hostx_add_window(xcb_window_t win, KdScreenInfo *screen)
+{
+    if (win == XCB_WINDOW_NONE)
+        return;
+
+    /* ephyr's SIGIO handler looks windows up */
+    OsBlockSIGIO();
+    if ((HostX.n_windows + 1) * 2 > (1 << HostX.windows_bits)) {
+        EphyrHostWindow *old = HostX.windows;
+        int i, old_size = old ? 1 << HostX.windows_bits : 0;
+
+        HostX.windows_bits = old ? HostX.windows_bits + 1 : 4;
+        HostX.windows = calloc(1 << HostX.windows_bits,
+                               sizeof(EphyrHostWindow));
+        if (!HostX.windows) {
+            fprintf(stderr, "\nXephyr out of memory\n");
+            exit(1);
+        }
+        HostX.n_windows = 0;
+        for (i = 0; i < old_size; i++) {
+            if (old[i].win)
+                hostx_insert_window(old[i].win, old[i].screen);
+        }
+        free(old);
+    }
+
+    hostx_insert_window(win, screen);
+    OsReleaseSIGIO();
+}
+
+static void
+hostx_remove_window(xcb_window_t win)
+{
+    unsigned int mask, i, j;
+
+    if (!HostX.windows || win == XCB_WINDOW_NONE)
+        return;
+
+    OsBlockSIGIO();
+    mask = (1u << HostX.windows_bits) - 1;
+    for (i = hostx_window_hash(win); HostX.windows[i].win != win;
+         i = (i + 1) & mask) {
+        if (!HostX.windows[i].win) {
+            OsReleaseSIGIO();
+            return;
+        }
+    }
+
+    /* Shift back the entries that probed past the freed slot */
+    HostX.windows[i].win = XCB_WINDOW_NONE;
+    HostX.n_windows--;
+    for (j = (i + 1) & mask; HostX.windows[j].win; j = (j + 1) & mask) {
+        unsigned int home = hostx_window_hash(HostX.windows[j].win);
+
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            HostX.windows[i] = HostX.windows[j];
+            HostX.windows[j].win = XCB_WINDOW_NONE;
+            i = j;
+        }
+    }
+    OsReleaseSIGIO();
+}
+
+/**
+ * The screen a host window belongs to: its own window, the one given
+ * with -parent, or a GL window created for it by hostx_create_window().
+ */
+KdScreenInfo *
+hostx_screen_from_window(xcb_window_t win)
+{
+    unsigned int mask, i;
+
+    if (!HostX.windows || win == XCB_WINDOW_NONE)
+        return NULL;
+
+    mask = (1u << HostX.windows_bits) - 1;
+    for (i = hostx_window_hash(win); HostX.windows[i].win; i = (i + 1) & mask) {
+        if (HostX.windows[i].win == win)
+            return HostX.windows[i].screen;
+    }
+
+    return NULL;
+}
+
 void
 hostx_set_display_name(char *name)
 {
@@ -336,6 +513,20 @@ hostx_get_output_geometry(const char *output,
     }
 }
 
+void
+hostx_use_shm_buffers(int n)
+{
+    HostX.n_shm_buffers = n;
+}
+
+void
+hostx_set_box_cost(int shm, int put)
+{
+    HostX.box_cost_set = TRUE;
+    HostX.box_cost_shm = shm;
+    HostX.box_cost_put = put;
+}
+
 void
 hostx_use_fullscreen(void)
 {
@@ -411,6 +602,165 @@ hostx_set_title(char *title)
 #pragma does_not_return(exit)
 #endif
 
+#ifdef EPHYR_SHM_FD
+static int
+hostx_memfd_create(void)
+{
+    return syscall(SYS_memfd_create, "xephyr", MFD_CLOEXEC);
+}
+
+/* Check that the host speaks MIT-SHM 1.2 and can map one of our memfds */
+static Bool
+hostx_probe_shm_fd(void)
+{
+    xcb_shm_query_version_cookie_t version_cookie;
+    xcb_shm_query_version_reply_t *version;
+    xcb_generic_error_t *e;
+    xcb_void_cookie_t cookie;
+    xcb_shm_seg_t shmseg;
+    Bool ok;
+    int fd;
+
+    version_cookie = xcb_shm_query_version(HostX.conn);
+    version = xcb_shm_query_version_reply(HostX.conn, version_cookie, NULL);
+    ok = version && (version->major_version > 1 ||
+                     (version->major_version == 1 &&
+                      version->minor_version >= 2));
+    free(version);
+    if (!ok)
+        return FALSE;
+
+    fd = hostx_memfd_create();
+    if (fd < 0)
+        return FALSE;
+    if (ftruncate(fd, getpagesize()) < 0) {
+        close(fd);
+        return FALSE;
+    }
+
+    /* xcb closes the fd once it's sent */
+    shmseg = xcb_generate_id(HostX.conn);
+    cookie = xcb_shm_attach_fd_checked(HostX.conn, shmseg, fd, TRUE);
+    e = xcb_request_check(HostX.conn, cookie);
+    if (e) {
+        free(e);
+        return FALSE;
+    }
+
+    xcb_shm_detach(HostX.conn, shmseg);
+    return TRUE;
+}
+#endif /* EPHYR_SHM_FD */
+
+/* Check that the host can attach our SysV segments; it can't from
+ * another IPC namespace, for instance.
+ */
+static Bool
+hostx_probe_shm_sysv(void)
+{
+    xcb_shm_segment_info_t shminfo;
+    xcb_generic_error_t *e;
+    xcb_void_cookie_t cookie;
+    Bool ok = TRUE;
+
+    shminfo.shmid = shmget(IPC_PRIVATE, 1, IPC_CREAT | 0600);
+    if (shminfo.shmid < 0)
+        return FALSE;
+    shminfo.shmaddr = shmat(shminfo.shmid, 0, 0);
+
+    shminfo.shmseg = xcb_generate_id(HostX.conn);
+    cookie = xcb_shm_attach_checked(HostX.conn, shminfo.shmseg,
+                                    shminfo.shmid, TRUE);
+    e = xcb_request_check(HostX.conn, cookie);
+
+    if (e) {
+        ok = FALSE;
+        free(e);
+    }
+    else
+        xcb_shm_detach(HostX.conn, shminfo.shmseg);
+
+    if (shminfo.shmaddr != (void *) -1)
+        shmdt(shminfo.shmaddr);
+    shmctl(shminfo.shmid, IPC_RMID, 0);
+
+    return ok;
+}
+
+/* Have a held host key send presses only, ended by a single release,
+ * rather than a release/press pair per repeat: see ephyrProcessKeyPress().
+ *
+ * Once we have said we speak XKB, the host no longer sends us core
+ * MappingNotify for keyboard changes it reports through XKB, so ask for
+ * those events instead: see hostx_is_keymap_notify().
+ */
+static Bool
+hostx_use_detectable_autorepeat(void)
+{
+    const xcb_query_extension_reply_t *xkb_rep;
+    xcb_xkb_use_extension_reply_t *use;
+    xcb_xkb_per_client_flags_reply_t *flags;
+    Bool ok;
+
+    xkb_rep = xcb_get_extension_data(HostX.conn, &xcb_xkb_id);
+    if (!xkb_rep || !xkb_rep->present)
+        return FALSE;
+
+    use = xcb_xkb_use_extension_reply(HostX.conn,
+              xcb_xkb_use_extension(HostX.conn, XCB_XKB_MAJOR_VERSION,
+                                    XCB_XKB_MINOR_VERSION), NULL);
+    ok = use && use->supported;
+    free(use);
+    if (!ok)
+        return FALSE;
+
+    HostX.xkb_first_event = xkb_rep->first_event;
+    xcb_xkb_select_events(HostX.conn, XCB_XKB_ID_USE_CORE_KBD,
+                          XCB_XKB_EVENT_TYPE_NEW_KEYBOARD_NOTIFY |
+                          XCB_XKB_EVENT_TYPE_MAP_NOTIFY,
+                          0,
+                          XCB_XKB_EVENT_TYPE_NEW_KEYBOARD_NOTIFY |
+                          XCB_XKB_EVENT_TYPE_MAP_NOTIFY,
+                          XCB_XKB_MAP_PART_KEY_SYMS |
+                          XCB_XKB_MAP_PART_MODIFIER_MAP,
+                          XCB_XKB_MAP_PART_KEY_SYMS |
+                          XCB_XKB_MAP_PART_MODIFIER_MAP,
+                          NULL);
+
+    flags = xcb_xkb_per_client_flags_reply(HostX.conn,
+                xcb_xkb_per_client_flags(HostX.conn,
+                                         XCB_XKB_ID_USE_CORE_KBD,
+                                         XCB_XKB_PER_CLIENT_FLAG_DETECTABLE_AUTO_REPEAT,
+                                         XCB_XKB_PER_CLIENT_FLAG_DETECTABLE_AUTO_REPEAT,
+                                         0, 0, 0), NULL);
+    ok = flags &&
+        (flags->value & XCB_XKB_PER_CLIENT_FLAG_DETECTABLE_AUTO_REPEAT);
+    free(flags);
+
+    return ok;
+}
+
+/* Raw events are only worth having with XI 2.1 semantics, where they
+ * still reach us while we hold the pointer grab. */
+static void
+hostx_init_xi2(void)
+{
+    const xcb_query_extension_reply_t *xi_rep;
+    xcb_input_xi_query_version_reply_t *version;
+
+    xi_rep = xcb_get_extension_data(HostX.conn, &xcb_input_id);
+    if (!xi_rep || !xi_rep->present)
+        return;
+
+    version = xcb_input_xi_query_version_reply(HostX.conn,
+                  xcb_input_xi_query_version(HostX.conn, 2, 2), NULL);
+    if (version && (version->major_version > 2 ||
+                    (version->major_version == 2 &&
+                     version->minor_version >= 2)))
+        HostX.xi_opcode = xi_rep->major_opcode;
+    free(version);
+}
+
 int
 hostx_init(void)
 {
@@ -435,7 +785,8 @@ hostx_init(void)
         | XCB_EVENT_MASK_KEY_PRESS
         | XCB_EVENT_MASK_KEY_RELEASE
         | XCB_EVENT_MASK_EXPOSURE
-        | XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+        | XCB_EVENT_MASK_STRUCTURE_NOTIFY
+        | XCB_EVENT_MASK_FOCUS_CHANGE;
     attr_mask |= XCB_CW_EVENT_MASK;
 
     EPHYR_DBG("mark");
@@ -484,8 +835,10 @@ hostx_init(void)
         EphyrScrPriv *scrpriv = screen->driver;
 
         scrpriv->win = xcb_generate_id(HostX.conn);
+        hostx_add_window(scrpriv->win, screen);
+        hostx_add_window(scrpriv->win_pre_existing, screen);
         scrpriv->server_depth = HostX.depth;
-        scrpriv->ximg = NULL;
+        scrpriv->n_images = 0;
         scrpriv->win_x = 0;
         scrpriv->win_y = 0;
 
@@ -640,32 +993,29 @@ hostx_init(void)
         HostX.have_shm = FALSE;
     }
     else {
-        /* Really really check we have shm - better way ?*/
-        xcb_shm_segment_info_t shminfo;
-        xcb_generic_error_t *e;
-        xcb_void_cookie_t cookie;
-        xcb_shm_seg_t shmseg;
+        HostX.shm_first_event = shm_rep->first_event;
+        if (HostX.n_shm_buffers < 1)
+            HostX.n_shm_buffers = 1;
 
-        HostX.have_shm = TRUE;
-
-        shminfo.shmid = shmget(IPC_PRIVATE, 1, IPC_CREAT|0777);
-        shminfo.shmaddr = shmat(shminfo.shmid,0,0);
-
-        shmseg = xcb_generate_id(HostX.conn);
-        cookie = xcb_shm_attach_checked(HostX.conn, shmseg, shminfo.shmid,
-                                        TRUE);
-        e = xcb_request_check(HostX.conn, cookie);
+#ifdef EPHYR_SHM_FD
+        HostX.have_shm_fd = hostx_probe_shm_fd();
+#endif
+        HostX.have_shm_sysv = hostx_probe_shm_sysv();
+        HostX.have_shm = HostX.have_shm_fd || HostX.have_shm_sysv;
 
-        if (e) {
+        if (!HostX.have_shm)
             fprintf(stderr, "\nXephyr unable to use SHM XImages\n");
-            HostX.have_shm = FALSE;
-            free(e);
-        }
-
-        shmdt(shminfo.shmaddr);
-        shmctl(shminfo.shmid, IPC_RMID, 0);
+        else
+            EPHYR_LOG("SHM segments: memfd %s, SysV %s\n",
+                      HostX.have_shm_fd ? "yes" : "no",
+                      HostX.have_shm_sysv ? "yes" : "no");
     }
 
+    hostx_init_xi2();
+
+    if (!hostx_use_detectable_autorepeat())
+        EPHYR_LOG("host keys will repeat with release/press pairs\n");
+
     xcb_flush(HostX.conn);
 
     /* Setup the pause time between paints when debugging updates */
@@ -705,7 +1055,7 @@ hostx_get_bpp(KdScreenInfo *screen)
     if (host_depth_matches_server(scrpriv))
         return HostX.visual->bits_per_rgb_value;
     else
-        return scrpriv->server_depth; /*XXX correct ?*/
+        return hostx_server_bpp(scrpriv->server_depth);
 }
 
 void
@@ -722,12 +1072,26 @@ hostx_get_visual_masks(KdScreenInfo *screen,
         *gmsk = HostX.visual->green_mask;
         *bmsk = HostX.visual->blue_mask;
     }
+    else if (scrpriv->server_depth == 15) {
+        *rmsk = 0x7c00;
+        *gmsk = 0x03e0;
+        *bmsk = 0x001f;
+    }
     else if (scrpriv->server_depth == 16) {
-        /* Assume 16bpp 565 */
         *rmsk = 0xf800;
         *gmsk = 0x07e0;
         *bmsk = 0x001f;
     }
+    else if (scrpriv->server_depth == 24) {
+        *rmsk = 0xff0000;
+        *gmsk = 0x00ff00;
+        *bmsk = 0x0000ff;
+    }
+    else if (scrpriv->server_depth == 30) {
+        *rmsk = 0x3ff00000;
+        *gmsk = 0x000ffc00;
+        *bmsk = 0x000003ff;
+    }
     else {
         *rmsk = 0x0;
         *gmsk = 0x0;
@@ -758,6 +1122,7 @@ hostx_set_cmap_entry(unsigned char idx,
 /* XXX Not sure if this is correct for 8 on 16, but this works for 8 on 24.*/
     static int rshift, bshift, gshift = 0;
     static int first_time = 1;
+    int i;
 
     if (first_time) {
         first_time = 0;
@@ -768,6 +1133,222 @@ hostx_set_cmap_entry(unsigned char idx,
     HostX.cmap[idx] = ((r << rshift) & HostX.visual->red_mask) |
         ((g << gshift) & HostX.visual->green_mask) |
         ((b << bshift) & HostX.visual->blue_mask);
+
+    for (i = 0; i < HostX.n_screens; i++) {
+        EphyrScrPriv *scrpriv = HostX.screens[i]->driver;
+
+        if (scrpriv && scrpriv->convert)
+            ephyr_convert_set_palette_entry(scrpriv->convert, idx,
+                                            HostX.cmap[idx]);
+    }
+}
+
+static void
+hostx_release_shm_fd(EphyrHostImage *image)
+{
+    /* Completions still on their way refer to the old segment and are
+     * ignored by hostx_paint_complete() */
+    xcb_shm_detach(HostX.conn, image->shminfo.shmseg);
+    munmap(image->shminfo.shmaddr, image->shm_size);
+    close(image->shm_fd);
+    memset(image, 0, sizeof(*image));
+}
+
+#ifdef EPHYR_SHM_FD
+/*
+ * Make @image's memfd segment at least @size bytes.  A segment kept from
+ * a previous hostx_screen_init() only grows: the file is extended in
+ * place and remapped, and the host is handed the same fd again so that
+ * it maps the new size too.
+ */
+static Bool
+hostx_map_shm_fd(EphyrHostImage *image, size_t size)
+{
+    void *addr;
+    int fd;
+
+    if (image->shm_size >= size)
+        return TRUE;
+
+    if (image->shm_size) {
+        xcb_shm_detach(HostX.conn, image->shminfo.shmseg);
+        munmap(image->shminfo.shmaddr, image->shm_size);
+        image->shminfo.shmaddr = NULL;
+        image->shm_size = 0;
+        image->puts_pending = 0;
+        fd = image->shm_fd;
+    }
+    else {
+        fd = hostx_memfd_create();
+        if (fd < 0)
+            return FALSE;
+    }
+
+    if (ftruncate(fd, size) < 0)
+        goto bail;
+
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        goto bail;
+
+    image->shm_fd = fd;
+    image->shm_size = size;
+    image->shminfo.shmaddr = addr;
+    image->shminfo.shmid = -1;
+    image->shminfo.shmseg = xcb_generate_id(HostX.conn);
+
+    /* xcb closes the fd it sends, keep ours for the next resize */
+    fd = dup(fd);
+    if (fd < 0) {
+        munmap(addr, size);
+        image->shminfo.shmaddr = NULL;
+        image->shm_size = 0;
+        fd = image->shm_fd;
+        goto bail;
+    }
+    xcb_shm_attach_fd(HostX.conn, image->shminfo.shmseg, fd, FALSE);
+
+    EPHYR_DBG("memfd SHM segment of %zu bytes at %p", size, addr);
+    return TRUE;
+
+ bail:
+    close(fd);
+    memset(image, 0, sizeof(*image));
+    return FALSE;
+}
+#endif /* EPHYR_SHM_FD */
+
+static Bool
+hostx_create_sysv_image(EphyrHostImage *image, size_t size)
+{
+    image->shminfo.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+    if (image->shminfo.shmid < 0) {
+        EPHYR_DBG("Can't create SHM Segment, falling back to plain XImages");
+        return FALSE;
+    }
+
+    image->shminfo.shmaddr = shmat(image->shminfo.shmid, 0, 0);
+    if (image->shminfo.shmaddr == (uint8_t *) -1) {
+        EPHYR_DBG
+            ("Can't attach SHM Segment, falling back to plain XImages");
+        shmctl(image->shminfo.shmid, IPC_RMID, 0);
+        image->shminfo.shmaddr = NULL;
+        return FALSE;
+    }
+
+    EPHYR_DBG("SHM segment attached %p", image->shminfo.shmaddr);
+    image->shminfo.shmseg = xcb_generate_id(HostX.conn);
+    xcb_shm_attach(HostX.conn,
+                   image->shminfo.shmseg,
+                   image->shminfo.shmid,
+                   FALSE);
+    image->puts_pending = 0;
+    return TRUE;
+}
+
+/*
+ * Set up @image as a SHM XImage, preferring a memfd segment, which isn't
+ * bound by the SysV limits nor by IPC namespaces.  A memfd segment kept
+ * by hostx_destroy_images() is reused, and grown if needed.
+ */
+static Bool
+hostx_create_shm_image(EphyrHostImage *image, int width, int height)
+{
+    xcb_image_t *ximg;
+    size_t size;
+    Bool ok = FALSE;
+
+    ximg = xcb_image_create_native(HostX.conn,
+                                   width,
+                                   height,
+                                   XCB_IMAGE_FORMAT_Z_PIXMAP,
+                                   HostX.depth,
+                                   NULL,
+                                   ~0,
+                                   NULL);
+    size = (size_t) ximg->stride * height;
+
+#ifdef EPHYR_SHM_FD
+    if (image->shm_size || HostX.have_shm_fd)
+        ok = hostx_map_shm_fd(image, size);
+#endif
+    if (!ok && HostX.have_shm_sysv)
+        ok = hostx_create_sysv_image(image, size);
+
+    if (!ok) {
+        xcb_image_destroy(ximg);
+        memset(image, 0, sizeof(*image));
+        return FALSE;
+    }
+
+    image->ximg = ximg;
+    image->ximg->data = image->shminfo.shmaddr;
+    return TRUE;
+}
+
+/*
+ * Tear down the host images of @scrpriv.  With @keep_fd_segments, memfd
+ * segments stay mapped and attached for hostx_create_shm_image() to
+ * reuse; only their XImage goes away.
+ */
+static void
+hostx_destroy_images(EphyrScrPriv *scrpriv, Bool keep_fd_segments)
+{
+    int i;
+
+    for (i = 0; i < EPHYR_MAX_HOST_IMAGES; i++) {
+        EphyrHostImage *image = &scrpriv->images[i];
+
+        if (image->shm_size) {
+            if (image->ximg)
+                xcb_image_destroy(image->ximg);
+            image->ximg = NULL;
+            if (!keep_fd_segments)
+                hostx_release_shm_fd(image);
+            continue;
+        }
+
+        if (!image->ximg)
+            continue;
+
+        if (image->shminfo.shmaddr) {
+            /* Completions still on their way refer to the old segment
+             * and are ignored by hostx_paint_complete() */
+            xcb_shm_detach(HostX.conn, image->shminfo.shmseg);
+            xcb_image_destroy(image->ximg);
+            shmdt(image->shminfo.shmaddr);
+            shmctl(image->shminfo.shmid, IPC_RMID, 0);
+        }
+        else {
+            free(image->ximg->data);
+            image->ximg->data = NULL;
+
+            xcb_image_destroy(image->ximg);
+        }
+        memset(image, 0, sizeof(*image));
+    }
+
+    scrpriv->n_images = 0;
+    scrpriv->cur_image = 0;
+
+    free(scrpriv->fb_data);
+    scrpriv->fb_data = NULL;
+
+    ephyr_convert_destroy(scrpriv->convert);
+    scrpriv->convert = NULL;
+}
+
+/**
+ * hostx_screen_fini releases everything hostx_screen_init() made for the
+ * screen, memfd segments included.
+ */
+void
+hostx_screen_fini(KdScreenInfo *screen)
+{
+    EphyrScrPriv *scrpriv = screen->driver;
+
+    if (scrpriv)
+        hostx_destroy_images(scrpriv, FALSE);
 }
 
 /**
@@ -781,6 +1362,11 @@ hostx_set_cmap_entry(unsigned char idx,
  * hostx_screen_init() creates an XImage, using MIT-SHM if it's available.
  * buffer_height can be used to create a larger offscreen buffer, which is used
  * by fakexa for storing offscreen pixmap data.
+ *
+ * When more than one SHM buffer was asked for (-shm-buffers), one segment
+ * per buffer is created and clients render into a private framebuffer
+ * instead; damaged boxes are copied into a segment the host isn't reading
+ * right before they are put.
  */
 void *
 hostx_screen_init(KdScreenInfo *screen,
@@ -799,74 +1385,67 @@ hostx_screen_init(KdScreenInfo *screen,
     EPHYR_DBG("host_screen=%p x=%d, y=%d, wxh=%dx%d, buffer_height=%d",
               host_screen, x, y, width, height, buffer_height);
 
-    if (scrpriv->ximg != NULL) {
-        /* Free up the image data if previously used
-         * i.ie called by server reset
-         */
+    /* Free up the image data if previously used
+     * i.ie called on resize, where memfd segments are kept so they can
+     * grow in place; hostx_screen_fini() releases them for good.
+     */
+    hostx_destroy_images(scrpriv, TRUE);
 
-        if (HostX.have_shm) {
-            xcb_shm_detach(HostX.conn, scrpriv->shminfo.shmseg);
-            xcb_image_destroy(scrpriv->ximg);
-            shmdt(scrpriv->shminfo.shmaddr);
-            shmctl(scrpriv->shminfo.shmid, IPC_RMID, 0);
-        }
-        else {
-            free(scrpriv->ximg->data);
-            scrpriv->ximg->data = NULL;
+    if (!ephyr_glamor && HostX.have_shm) {
+        int i;
+        /* A lone segment is what clients render into, so it has to hold
+         * the offscreen area too.  With several, only the visible part
+         * is ever copied to them.
+         */
+        int image_height = HostX.n_shm_buffers > 1 ? height : buffer_height;
 
-            xcb_image_destroy(scrpriv->ximg);
+        for (i = 0; i < HostX.n_shm_buffers; i++) {
+            if (!hostx_create_shm_image(&scrpriv->images[i],
+                                        width, image_height))
+                break;
+            scrpriv->n_images++;
         }
-    }
 
-    if (!ephyr_glamor && HostX.have_shm) {
-        scrpriv->ximg = xcb_image_create_native(HostX.conn,
-                                                width,
-                                                buffer_height,
-                                                XCB_IMAGE_FORMAT_Z_PIXMAP,
-                                                HostX.depth,
-                                                NULL,
-                                                ~0,
-                                                NULL);
-
-        scrpriv->shminfo.shmid =
-            shmget(IPC_PRIVATE,
-                   scrpriv->ximg->stride * buffer_height,
-                   IPC_CREAT | 0777);
-        scrpriv->ximg->data = shmat(scrpriv->shminfo.shmid, 0, 0);
-        scrpriv->shminfo.shmaddr = scrpriv->ximg->data;
-
-        if (scrpriv->ximg->data == (uint8_t *) -1) {
-            EPHYR_DBG
-                ("Can't attach SHM Segment, falling back to plain XImages");
+        if (scrpriv->n_images == 0)
             HostX.have_shm = FALSE;
-            xcb_image_destroy (scrpriv->ximg);
-            shmctl(scrpriv->shminfo.shmid, IPC_RMID, 0);
+        else if (scrpriv->n_images == 1 && image_height != buffer_height) {
+            /* Couldn't get more than one: fall back to rendering
+             * straight into a full-sized segment.
+             */
+            hostx_destroy_images(scrpriv, TRUE);
+            if (hostx_create_shm_image(&scrpriv->images[0],
+                                       width, buffer_height))
+                scrpriv->n_images = 1;
+            else
+                HostX.have_shm = FALSE;
         }
-        else {
-            EPHYR_DBG("SHM segment attached %p", scrpriv->shminfo.shmaddr);
-            scrpriv->shminfo.shmseg = xcb_generate_id(HostX.conn);
-            xcb_shm_attach(HostX.conn,
-                           scrpriv->shminfo.shmseg,
-                           scrpriv->shminfo.shmid,
-                           FALSE);
-            shm_success = TRUE;
+
+        /* Drop kept segments the new configuration doesn't use */
+        for (i = scrpriv->n_images; i < EPHYR_MAX_HOST_IMAGES; i++) {
+            if (scrpriv->images[i].shm_size)
+                hostx_release_shm_fd(&scrpriv->images[i]);
         }
+
+        shm_success = scrpriv->n_images > 0;
     }
 
     if (!ephyr_glamor && !shm_success) {
+        EphyrHostImage *image = &scrpriv->images[0];
+
         EPHYR_DBG("Creating image %dx%d for screen scrpriv=%p\n",
                   width, buffer_height, scrpriv);
-        scrpriv->ximg = xcb_image_create_native(HostX.conn,
-                                                    width,
-                                                    buffer_height,
-                                                    XCB_IMAGE_FORMAT_Z_PIXMAP,
-                                                    HostX.depth,
-                                                    NULL,
-                                                    ~0,
-                                                    NULL);
-
-        scrpriv->ximg->data =
-            malloc(scrpriv->ximg->stride * buffer_height);
+        image->ximg = xcb_image_create_native(HostX.conn,
+                                              width,
+                                              buffer_height,
+                                              XCB_IMAGE_FORMAT_Z_PIXMAP,
+                                              HostX.depth,
+                                              NULL,
+                                              ~0,
+                                              NULL);
+
+        image->ximg->data =
+            malloc(image->ximg->stride * buffer_height);
+        scrpriv->n_images = 1;
     }
 
     {
@@ -917,22 +1496,52 @@ hostx_screen_init(KdScreenInfo *screen,
         return NULL;
     } else
 #endif
-    if (host_depth_matches_server(scrpriv)) {
-        *bytes_per_line = scrpriv->ximg->stride;
-        *bits_per_pixel = scrpriv->ximg->bpp;
+    if (host_depth_matches_server(scrpriv) && scrpriv->n_images == 1) {
+        *bytes_per_line = scrpriv->images[0].ximg->stride;
+        *bits_per_pixel = scrpriv->images[0].ximg->bpp;
 
         EPHYR_DBG("Host matches server");
-        return scrpriv->ximg->data;
+        return scrpriv->images[0].ximg->data;
+    }
+    else if (host_depth_matches_server(scrpriv)) {
+        int stride = scrpriv->images[0].ximg->stride;
+
+        *bytes_per_line = stride;
+        *bits_per_pixel = scrpriv->images[0].ximg->bpp;
+
+        EPHYR_DBG("Host matches server, %d SHM buffers", scrpriv->n_images);
+        scrpriv->fb_data = malloc(stride * buffer_height);
+        return scrpriv->fb_data;
     }
     else {
-        int bytes_per_pixel = scrpriv->server_depth >> 3;
-        int stride = (width * bytes_per_pixel + 0x3) & ~0x3;
+        int server_bpp = hostx_server_bpp(scrpriv->server_depth);
+        int stride = (width * (server_bpp >> 3) + 0x3) & ~0x3;
+        xcb_image_t *ximg = scrpriv->images[0].ximg;
+        EphyrPixelFormat server = { scrpriv->server_depth, server_bpp,
+                                    0, 0, 0, 0 };
+        EphyrPixelFormat host = { HostX.depth, ximg->bpp, ximg->byte_order,
+                                  HostX.visual->red_mask,
+                                  HostX.visual->green_mask,
+                                  HostX.visual->blue_mask };
+        CARD32 rmsk, gmsk, bmsk;
 
         *bytes_per_line = stride;
-        *bits_per_pixel = scrpriv->server_depth;
+        *bits_per_pixel = server_bpp;
+
+        hostx_get_visual_masks(screen, &rmsk, &gmsk, &bmsk);
+        server.red_mask = rmsk;
+        server.green_mask = gmsk;
+        server.blue_mask = bmsk;
 
-        EPHYR_DBG("server bpp %i", bytes_per_pixel);
+        EPHYR_DBG("server bpp %i", server_bpp);
         scrpriv->fb_data = malloc (stride * buffer_height);
+        scrpriv->fb_stride = stride;
+        scrpriv->convert = ephyr_convert_create(&server, &host, HostX.cmap);
+        if (!scrpriv->convert) {
+            fprintf(stderr, "\nXephyr cannot draw depth %d on a %d bpp "
+                    "host visual\n", scrpriv->server_depth, ximg->bpp);
+            exit(1);
+        }
         return scrpriv->fb_data;
     }
 }
@@ -940,30 +1549,118 @@ hostx_screen_init(KdScreenInfo *screen,
 static void hostx_paint_debug_rect(KdScreenInfo *screen,
                                    int x, int y, int width, int height);
 
-void
-hostx_paint_rect(KdScreenInfo *screen,
-                 int sx, int sy, int dx, int dy, int width, int height)
+/*
+ * Whether the host may still be reading @image.  A put the host failed,
+ * say on a window destroyed or resized under it, never gets its
+ * ShmCompletion: after EPHYR_SHM_PUT_TIMEOUT it is taken as completed,
+ * rather than holding the segment, and the screen's painting, for good.
+ */
+static Bool
+hostx_image_busy(EphyrHostImage *image)
 {
-    EphyrScrPriv *scrpriv = screen->driver;
+    if (image->puts_pending > 0 &&
+        (CARD32) (GetTimeInMillis() - image->put_time) >=
+        EPHYR_SHM_PUT_TIMEOUT)
+        image->puts_pending = 0;
 
-    EPHYR_DBG("painting in screen %d\n", scrpriv->mynum);
+    return image->puts_pending > 0;
+}
 
-#ifdef GLAMOR
-    if (ephyr_glamor) {
-        BoxRec box;
-        RegionRec region;
+/*
+ * Pick the host image the next batch of puts should go through: the
+ * first one the host is done reading, starting from the one used last.
+ * NULL if the host still reads all of them: writing into one would tear
+ * the frame being put, so the paint has to wait for a completion.
+ */
+static EphyrHostImage *
+hostx_get_paint_image(EphyrScrPriv *scrpriv)
+{
+    int i;
 
-        box.x1 = dx;
-        box.y1 = dy;
-        box.x2 = dx + width;
-        box.y2 = dy + height;
+    for (i = 0; i < scrpriv->n_images; i++) {
+        int idx = (scrpriv->cur_image + i) % scrpriv->n_images;
 
-        RegionInit(&region, &box, 1);
-        ephyr_glamor_damage_redisplay(scrpriv->glamor, &region);
-        RegionUninit(&region);
-        return;
+        if (!hostx_image_busy(&scrpriv->images[idx])) {
+            scrpriv->cur_image = idx;
+            return &scrpriv->images[idx];
+        }
     }
-#endif
+
+    return NULL;
+}
+
+/*
+ * Send a rectangle of @ximg with plain PutImage requests, as many as it
+ * takes to stay under the host's maximum request length (which includes
+ * BIG-REQUESTS, if the host has it).  Rows of a rectangle narrower than
+ * the image aren't contiguous, so they are packed into HostX.put_buf
+ * first; xcb is done with it once xcb_put_image() returns.
+ */
+static void
+hostx_put_sub_image(xcb_window_t win, xcb_image_t *ximg,
+                    int sx, int sy, int dx, int dy, int width, int height)
+{
+    uint32_t max_len = xcb_get_maximum_request_length(HostX.conn) * 4 -
+        sizeof(xcb_put_image_request_t);
+    int bytes_per_pixel = ximg->bpp >> 3;
+    int max_width = (max_len / bytes_per_pixel) & ~0x3;
+    int x, y, chunk_width, chunk_height;
+
+    for (x = 0; x < width; x += chunk_width) {
+        int row_len, max_rows;
+
+        chunk_width = min(width - x, max_width);
+        row_len = (chunk_width * bytes_per_pixel + 0x3) & ~0x3;
+        max_rows = max_len / row_len;
+
+        for (y = 0; y < height; y += chunk_height) {
+            uint8_t *data;
+            int i;
+
+            chunk_height = min(height - y, max_rows);
+
+            if (chunk_width == ximg->width && row_len == ximg->stride) {
+                /* full width: the rows are already packed */
+                data = ximg->data + (sy + y) * ximg->stride;
+            }
+            else {
+                size_t size = (size_t) row_len * chunk_height;
+
+                if (size > HostX.put_buf_size) {
+                    free(HostX.put_buf);
+                    HostX.put_buf = malloc(size);
+                    HostX.put_buf_size = HostX.put_buf ? size : 0;
+                    if (!HostX.put_buf)
+                        return;
+                }
+                data = HostX.put_buf;
+                for (i = 0; i < chunk_height; i++)
+                    memcpy(data + i * row_len,
+                           ximg->data + (sy + y + i) * ximg->stride +
+                           (sx + x) * bytes_per_pixel,
+                           chunk_width * bytes_per_pixel);
+            }
+
+            xcb_put_image(HostX.conn, XCB_IMAGE_FORMAT_Z_PIXMAP, win,
+                          HostX.gc, chunk_width, chunk_height,
+                          dx + x, dy + y, 0, HostX.depth,
+                          row_len * chunk_height, data);
+        }
+    }
+}
+
+/*
+ * Queue the requests that copy one rectangle of the screen's image to
+ * the host window.  Nothing is flushed here; callers decide when to
+ * wait for the host.  With MIT-SHM, the last put of a batch asks the
+ * host for a completion event.
+ */
+static void
+hostx_put_rect(KdScreenInfo *screen, EphyrHostImage *image,
+               int sx, int sy, int dx, int dy, int width, int height,
+               Bool last)
+{
+    EphyrScrPriv *scrpriv = screen->driver;
 
     /*
      *  Copy the image data updated by the shadow layer
@@ -974,70 +1671,340 @@ hostx_paint_rect(KdScreenInfo *screen,
         hostx_paint_debug_rect(screen, dx, dy, width, height);
     }
 
-    /* 
+    /*
      * If the depth of the ephyr server is less than that of the host,
      * the kdrive fb does not point to the ximage data but to a buffer
      * ( fb_data ), we shift the various bits from this onto the XImage
      * so they match the host.
      *
-     * Note, This code is pretty new ( and simple ) so may break on 
-     *       endian issues, 32 bpp host etc. 
-     *       Not sure if 8bpp case is right either. 
-     *       ... and it will be slower than the matching depth case.
+     * The converter was built by hostx_screen_init() for this server
+     * depth and the host image layout, masks and byte order.
      */
 
     if (!host_depth_matches_server(scrpriv)) {
-        int x, y, idx, bytes_per_pixel = (scrpriv->server_depth >> 3);
-        int stride = (scrpriv->win_width * bytes_per_pixel + 0x3) & ~0x3;
-        unsigned char r, g, b;
-        unsigned long host_pixel;
+        EphyrConvert *conv = scrpriv->convert;
+        int y, stride = scrpriv->fb_stride;
+        int bytes_per_pixel = conv->server.bpp >> 3;
+        int host_bytes_per_pixel = image->ximg->bpp >> 3;
 
         EPHYR_DBG("Unmatched host depth scrpriv=%p\n", scrpriv);
+
         for (y = sy; y < sy + height; y++)
-            for (x = sx; x < sx + width; x++) {
-                idx = y * stride + x * bytes_per_pixel;
+            conv->row(conv,
+                      image->ximg->data + y * image->ximg->stride +
+                      sx * host_bytes_per_pixel,
+                      scrpriv->fb_data + y * stride + sx * bytes_per_pixel,
+                      width);
+    }
+    else if (scrpriv->fb_data) {
+        /* Several SHM buffers: copy the box out of the private fb */
+        int y, stride = image->ximg->stride;
+        int offset = sx * (image->ximg->bpp >> 3);
+        int len = width * (image->ximg->bpp >> 3);
 
-                switch (scrpriv->server_depth) {
-                case 16:
-                {
-                    unsigned short pixel =
-                        *(unsigned short *) (scrpriv->fb_data + idx);
+        for (y = sy; y < sy + height; y++)
+            memcpy(image->ximg->data + y * stride + offset,
+                   scrpriv->fb_data + y * stride + offset, len);
+    }
 
-                    r = ((pixel & 0xf800) >> 8);
-                    g = ((pixel & 0x07e0) >> 3);
-                    b = ((pixel & 0x001f) << 3);
+    if (image->shminfo.shmaddr) {
+        xcb_image_shm_put(HostX.conn, scrpriv->win,
+                          HostX.gc, image->ximg,
+                          image->shminfo,
+                          sx, sy, dx, dy, width, height, last);
+    }
+    else {
+        hostx_put_sub_image(scrpriv->win, image->ximg,
+                            sx, sy, dx, dy, width, height);
+    }
+}
 
-                    host_pixel = (r << 16) | (g << 8) | (b);
+/*
+ * Finish a batch of hostx_put_rect() calls.  A SHM put is only finished
+ * once the host has read the segment, which it tells us with a
+ * ShmCompletion event, so we just flush here and let ephyrPoll() account
+ * for the completion.  Plain PutImage carries the pixels in the request
+ * itself; a single sync per batch is enough to pace the host.
+ */
+static void
+hostx_paint_submit(EphyrHostImage *image)
+{
+    if (image->shminfo.shmaddr) {
+        image->puts_pending++;
+        image->put_time = GetTimeInMillis();
+        xcb_flush(HostX.conn);
+    }
+    else {
+        xcb_aux_sync(HostX.conn);
+    }
+}
 
-                    xcb_image_put_pixel(scrpriv->ximg, x, y, host_pixel);
-                    break;
-                }
-                case 8:
-                {
-                    unsigned char pixel =
-                        *(unsigned char *) (scrpriv->fb_data + idx);
-                    xcb_image_put_pixel(scrpriv->ximg, x, y,
-                                        HostX.cmap[pixel]);
-                    break;
-                }
-                default:
-                    break;
-                }
-            }
+/**
+ * hostx_paint_rect copies one rectangle of the screen to the host window,
+ * unless the host is still reading every host image: then nothing is
+ * queued behind those puts and FALSE is returned, for the caller to keep
+ * the damage until hostx_paint_complete().
+ */
+Bool
+hostx_paint_rect(KdScreenInfo *screen,
+                 int sx, int sy, int dx, int dy, int width, int height)
+{
+    EphyrScrPriv *scrpriv = screen->driver;
+    EphyrHostImage *image;
+
+    EPHYR_DBG("painting in screen %d\n", scrpriv->mynum);
+
+#ifdef GLAMOR
+    if (ephyr_glamor) {
+        BoxRec box;
+        RegionRec region;
+
+        box.x1 = dx;
+        box.y1 = dy;
+        box.x2 = dx + width;
+        box.y2 = dy + height;
+
+        RegionInit(&region, &box, 1);
+        ephyr_glamor_damage_redisplay(scrpriv->glamor, &region);
+        RegionUninit(&region);
+        return TRUE;
     }
+#endif
 
-    if (HostX.have_shm) {
-        xcb_image_shm_put(HostX.conn, scrpriv->win,
-                          HostX.gc, scrpriv->ximg,
-                          scrpriv->shminfo,
-                          sx, sy, dx, dy, width, height, FALSE);
+    image = hostx_get_paint_image(scrpriv);
+    if (!image)
+        return FALSE;
+
+    hostx_put_rect(screen, image, sx, sy, dx, dy, width, height, TRUE);
+    hostx_paint_submit(image);
+    return TRUE;
+}
+
+/**
+ * hostx_paint_region copies every box of a damage region (given in screen
+ * coordinates) to the host window.
+ *
+ * All the boxes are queued first and the host is waited for only once, at
+ * the end of the batch, instead of paying a round trip per box.  With
+ * MIT-SHM that wait does not block: see hostx_paint_pending().
+ *
+ * Fragmented damage (text, mostly) is coalesced on the way: two boxes are
+ * sent as their bounding box when the pixels that adds cost less than
+ * the extra request would.  The region is banded, so neighbours in it are
+ * neighbours on screen and a single greedy pass does well.
+ *
+ * Returns FALSE, with nothing queued, when the host is still reading every
+ * host image; the caller keeps the damage for after the next completion.
+ */
+Bool
+hostx_paint_region(KdScreenInfo *screen, RegionPtr region)
+{
+    EphyrScrPriv *scrpriv = screen->driver;
+    EphyrHostImage *image;
+    int nbox = RegionNumRects(region);
+    BoxPtr pbox = RegionRects(region);
+    BoxRec cur;
+    int box_cost, nput = 0;
+
+    EPHYR_DBG("painting %d boxes in screen %d\n", nbox, scrpriv->mynum);
+
+#ifdef GLAMOR
+    if (ephyr_glamor) {
+        ephyr_glamor_damage_redisplay(scrpriv->glamor, region);
+        return TRUE;
     }
-    else {
-        xcb_image_put(HostX.conn, scrpriv->win, HostX.gc, scrpriv->ximg,
-                      dx, dy, 0);
+#endif
+
+    if (!nbox)
+        return TRUE;
+
+    image = hostx_get_paint_image(scrpriv);
+    if (!image)
+        return FALSE;
+
+    if (!HostX.box_cost_set)
+        box_cost = image->shminfo.shmaddr ?
+            EPHYR_BOX_COST_SHM : EPHYR_BOX_COST_PUT;
+    else
+        box_cost = image->shminfo.shmaddr ?
+            HostX.box_cost_shm : HostX.box_cost_put;
+
+    cur = *pbox++;
+    while (--nbox) {
+        BoxRec merged;
+        long cur_area = (long) (cur.x2 - cur.x1) * (cur.y2 - cur.y1);
+        long box_area = (long) (pbox->x2 - pbox->x1) * (pbox->y2 - pbox->y1);
+
+        merged.x1 = min(cur.x1, pbox->x1);
+        merged.y1 = min(cur.y1, pbox->y1);
+        merged.x2 = max(cur.x2, pbox->x2);
+        merged.y2 = max(cur.y2, pbox->y2);
+
+        if ((long) (merged.x2 - merged.x1) * (merged.y2 - merged.y1) <=
+            cur_area + box_area + box_cost) {
+            cur = merged;
+        }
+        else {
+            hostx_put_rect(screen, image, cur.x1, cur.y1, cur.x1, cur.y1,
+                           cur.x2 - cur.x1, cur.y2 - cur.y1, FALSE);
+            nput++;
+            cur = *pbox;
+        }
+        pbox++;
     }
 
-    xcb_aux_sync(HostX.conn);
+    hostx_put_rect(screen, image, cur.x1, cur.y1, cur.x1, cur.y1,
+                   cur.x2 - cur.x1, cur.y2 - cur.y1, TRUE);
+    nput++;
+
+    EPHYR_DBG("%d boxes sent as %d puts\n", RegionNumRects(region), nput);
+
+    hostx_paint_submit(image);
+    return TRUE;
+}
+
+/**
+ * Whether the host is still reading every one of the screen's SHM
+ * segments from previous paints, or with glamor, still swapping the last
+ * frame.  Callers should keep accumulating damage rather than queueing
+ * more puts behind them.  Neither wait outlasts its timeout.
+ */
+Bool
+hostx_paint_pending(KdScreenInfo *screen)
+{
+    EphyrScrPriv *scrpriv = screen->driver;
+    int i;
+
+    if (!scrpriv)
+        return FALSE;
+
+#ifdef GLAMOR
+    if (ephyr_glamor)
+        return ephyr_glamor_swap_pending(scrpriv->glamor);
+#endif
+
+    for (i = 0; i < scrpriv->n_images; i++)
+        if (!hostx_image_busy(&scrpriv->images[i]))
+            return FALSE;
+
+    return scrpriv->n_images > 0;
+}
+
+Bool
+hostx_is_shm_completion(xcb_generic_event_t *xev)
+{
+    return HostX.have_shm &&
+        (xev->response_type & 0x7f) ==
+        HostX.shm_first_event + XCB_SHM_COMPLETION;
+}
+
+/**
+ * Whether @xev is an XKB event saying the host keyboard or its keymap
+ * changed, which core MappingNotify no longer tells us about.
+ */
+Bool
+hostx_is_keymap_notify(xcb_generic_event_t *xev)
+{
+    uint8_t xkb_type;
+
+    if (!HostX.xkb_first_event ||
+        (xev->response_type & 0x7f) != HostX.xkb_first_event)
+        return FALSE;
+
+    /* every XKB event carries its type right after response_type */
+    xkb_type = ((xcb_xkb_map_notify_event_t *) xev)->xkbType;
+    return xkb_type == XCB_XKB_NEW_KEYBOARD_NOTIFY ||
+        xkb_type == XCB_XKB_MAP_NOTIFY;
+}
+
+/**
+ * Start or stop asking the host for XI2 raw pointer motion, which is
+ * only ever sent to root windows.  Returns whether it is now selected.
+ */
+Bool
+hostx_select_raw_motion(Bool on)
+{
+    struct {
+        xcb_input_event_mask_t head;
+        uint32_t mask;
+    } mask;
+
+    if (!HostX.xi_opcode)
+        return FALSE;
+
+    mask.head.deviceid = XCB_INPUT_DEVICE_ALL_MASTER;
+    mask.head.mask_len = 1;
+    mask.mask = on ? XCB_INPUT_XI_EVENT_MASK_RAW_MOTION : 0;
+    xcb_input_xi_select_events(HostX.conn, HostX.winroot, 1, &mask.head);
+    xcb_flush(HostX.conn);
+
+    return on;
+}
+
+/**
+ * If @xev is an XI2 RawMotion event, return TRUE and its unaccelerated
+ * x and y deltas, with their fractional part, and its timestamp.
+ */
+Bool
+hostx_get_raw_motion(xcb_generic_event_t *xev, double *dx, double *dy,
+                     xcb_timestamp_t *time)
+{
+    xcb_ge_generic_event_t *ge = (xcb_ge_generic_event_t *) xev;
+    xcb_input_raw_motion_event_t *raw;
+    uint32_t *valuators;
+    xcb_input_fp3232_t *values;
+    int axis, n = 0;
+
+    if (!HostX.xi_opcode ||
+        (xev->response_type & 0x7f) != XCB_GE_GENERIC ||
+        ge->extension != HostX.xi_opcode ||
+        ge->event_type != XCB_INPUT_RAW_MOTION)
+        return FALSE;
+
+    raw = (xcb_input_raw_motion_event_t *) xev;
+    *time = raw->time;
+    valuators = xcb_input_raw_button_press_valuator_mask(raw);
+    values = xcb_input_raw_button_press_axisvalues_raw(raw);
+
+    /* one value per bit set in the mask; x and y are axes 0 and 1 */
+    *dx = *dy = 0;
+    for (axis = 0; axis < 2 && raw->valuators_len; axis++) {
+        if (valuators[0] & (1 << axis)) {
+            double v = values[n].integral + values[n].frac / 4294967296.0;
+
+            if (axis == 0)
+                *dx = v;
+            else
+                *dy = v;
+            n++;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * Account for a ShmCompletion event received from the host for one of
+ * the screen's puts.
+ */
+void
+hostx_paint_complete(KdScreenInfo *screen, xcb_shm_seg_t shmseg)
+{
+    EphyrScrPriv *scrpriv = screen->driver;
+    int i;
+
+    if (!scrpriv)
+        return;
+
+    for (i = 0; i < scrpriv->n_images; i++) {
+        EphyrHostImage *image = &scrpriv->images[i];
+
+        if (image->shminfo.shmaddr && image->shminfo.shmseg == shmseg) {
+            if (image->puts_pending > 0)
+                image->puts_pending--;
+            break;
+        }
+    }
 }
 
 static void
@@ -1067,6 +2034,40 @@ hostx_paint_debug_rect(KdScreenInfo *screen,
     nanosleep(&tspec, NULL);
 }
 
+static void
+hostx_load_modifier_map(void)
+{
+    xcb_get_modifier_mapping_cookie_t cookie;
+    xcb_get_modifier_mapping_reply_t *reply;
+    xcb_keycode_t *keycodes;
+    int i, j;
+
+    cookie = xcb_get_modifier_mapping(HostX.conn);
+    reply = xcb_get_modifier_mapping_reply(HostX.conn, cookie, NULL);
+
+    memset(HostX.key_modifiers, 0, sizeof(HostX.key_modifiers));
+    if (!reply)
+        return;
+
+    keycodes = xcb_get_modifier_mapping_keycodes(reply);
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < reply->keycodes_per_modifier; j++) {
+            xcb_keycode_t keycode =
+                keycodes[i * reply->keycodes_per_modifier + j];
+
+            if (keycode)
+                HostX.key_modifiers[keycode] |= 1 << i;
+        }
+    }
+
+    free(reply);
+}
+
+/**
+ * Read the host keyboard's keycode range and modifier bindings.  Called
+ * again on host MappingNotify, or its XKB equivalents, so that
+ * hostx_get_key_modifiers() follows remapped keys.
+ */
 void
 hostx_load_keymap(void)
 {
@@ -1079,6 +2080,17 @@ hostx_load_keymap(void)
 
     ephyrKeySyms.minKeyCode = min_keycode;
     ephyrKeySyms.maxKeyCode = max_keycode;
+
+    hostx_load_modifier_map();
+}
+
+/**
+ * The modifiers (XCB_MOD_MASK_* bits) a host keycode is bound to.
+ */
+int
+hostx_get_key_modifiers(uint8_t keycode)
+{
+    return HostX.key_modifiers[keycode];
 }
 
 xcb_connection_t *
@@ -1233,6 +2245,7 @@ hostx_create_window(int a_screen_number,
                       XCB_WINDOW_CLASS_COPY_FROM_PARENT,
                       a_visual_id, winmask, attrs);
 
+    hostx_add_window(win, HostX.screens[a_screen_number]);
     if (scrpriv->peer_win == XCB_NONE) {
         scrpriv->peer_win = win;
     }
@@ -1251,6 +2264,13 @@ hostx_create_window(int a_screen_number,
 int
 hostx_destroy_window(int a_win)
 {
+    KdScreenInfo *screen = hostx_screen_from_window(a_win);
+
+    /* Events already queued for the screen's peer window still need
+     * their screen, as they did when it was found by a linear search. */
+    if (screen && ((EphyrScrPriv *) screen->driver)->peer_win != a_win)
+        hostx_remove_window(a_win);
+
     xcb_destroy_window(HostX.conn, a_win);
     xcb_flush(HostX.conn);
     return TRUE;
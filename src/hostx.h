@@ -30,6 +30,7 @@
 #include <X11/Xmd.h>
 #include <xcb/xcb.h>
 #include <xcb/render.h>
+#include <xcb/shm.h>
 #include "ephyr.h"
 
 #define EPHYR_WANT_DEBUG 0
@@ -91,6 +92,12 @@ hostx_get_output_geometry(const char *output,
                           int *x, int *y,
                           int *width, int *height);
 
+void
+hostx_use_shm_buffers(int n);
+
+void
+hostx_set_box_cost(int shm, int put);
+
 void
 hostx_use_fullscreen(void);
 
@@ -149,12 +156,40 @@ void *hostx_screen_init(KdScreenInfo *screen,
                         int *bytes_per_line, int *bits_per_pixel);
 
 void
+hostx_screen_fini(KdScreenInfo *screen);
+
+Bool
 hostx_paint_rect(KdScreenInfo *screen,
                  int sx, int sy, int dx, int dy, int width, int height);
 
+Bool
+hostx_paint_region(KdScreenInfo *screen, RegionPtr region);
+
+Bool
+hostx_paint_pending(KdScreenInfo *screen);
+
+Bool
+hostx_is_shm_completion(xcb_generic_event_t *xev);
+
+Bool
+hostx_is_keymap_notify(xcb_generic_event_t *xev);
+
+void
+hostx_paint_complete(KdScreenInfo *screen, xcb_shm_seg_t shmseg);
+
+Bool
+hostx_select_raw_motion(Bool on);
+
+Bool
+hostx_get_raw_motion(xcb_generic_event_t *xev, double *dx, double *dy,
+                     xcb_timestamp_t *time);
+
 void
 hostx_load_keymap(void);
 
+int
+hostx_get_key_modifiers(uint8_t keycode);
+
 xcb_connection_t *
 hostx_get_xcbconn(void);
 
@@ -176,6 +211,9 @@ int hostx_create_window(int a_screen_number,
 
 int hostx_destroy_window(int a_win);
 
+KdScreenInfo *
+hostx_screen_from_window(xcb_window_t win);
+
 int hostx_set_window_geometry(int a_win, EphyrBox * a_geo);
 
 int hostx_set_window_bounding_rectangles(int a_window,
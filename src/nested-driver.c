@@ -62,7 +62,9 @@
 #define NESTED_MINOR_VERSION PACKAGE_VERSION_MINOR
 #define NESTED_PATCHLEVEL PACKAGE_VERSION_PATCHLEVEL
 
-#define TIMER_CALLBACK_INTERVAL 20
+/* Frames per second painted to the host, unless the FPS option says
+ * otherwise; the same as Xephyr's -fps default */
+#define NESTED_DEFAULT_FPS 60
 
 static MODULESETUPPROTO(NestedSetup);
 static void NestedIdentify(int flags);
@@ -109,7 +111,8 @@ typedef enum {
     OPTION_ACCELMETHOD,
 #endif
     OPTION_WMCLASS,
-    OPTION_WMNAME
+    OPTION_WMNAME,
+    OPTION_FPS
 } NestedOpts;
 
 typedef enum {
@@ -131,10 +134,14 @@ static SymTabRec NestedChipsets[] = {
  * [+] -output <NAME>       Attempt to run Xephyr fullscreen (restricted to given output geometry)
  * [-] -grayscale           Simulate 8bit grayscale
  * [-] -resizeable          Make Xephyr windows resizeable
+ * [-] -shm-buffers <n>     Paint through n (1-3) host SHM segments per screen
+ * [-] -box-cost <shm>,<put> Pixels worth one more put when merging damage boxes
+ * [+] -fps <n>             Paint at most n frames per second (default 60, 0 for no limit)
  *
  * #ifdef GLAMOR
  * [+] -glamor              Enable 2D acceleration using glamor
  * [+] -glamor_gles2        Enable 2D acceleration using glamor (with GLES2 only)
+ * [-] -swap-interval <n>   Host vblanks per glamor frame (0, 1, -1 for adaptive; default 1)
  * #endif
  *
  * [-] -fakexa              Simulate acceleration using software rendering
@@ -145,6 +152,7 @@ static SymTabRec NestedChipsets[] = {
  * #endif
  *
  * [-] -noxv                do not use XV
+ * [-] -noinputthread       read host events on the main thread
  * [+] -name [name]         define the name in the WM_CLASS property
  * [+] -title [title]       set the window title in the WM_NAME property
  */
@@ -162,6 +170,7 @@ static OptionInfoRec NestedOptions[] = {
 #endif
     { OPTION_WMCLASS,     "WMClass",     OPTV_STRING,  {0}, FALSE },
     { OPTION_WMNAME,      "WMName",      OPTV_STRING,  {0}, FALSE },
+    { OPTION_FPS,         "FPS",         OPTV_INTEGER, {0}, FALSE },
     { -1,                 NULL,          OPTV_NONE,    {0}, FALSE }
 };
 
@@ -219,6 +228,10 @@ typedef struct NestedPrivate
 #endif
     char *wmClass;
     char *wmName;
+    int redisplayInterval; /* ms between updates, 0 for no limit */
+    CARD32 nextRedisplay;
+    RegionRec pendingDamage; /* damage not yet sent to the host */
+    int hostFd; /* host connection, watched by NestedWakeupHandler() */
     NestedClientPrivatePtr clientData;
     CreateScreenResourcesProcPtr CreateScreenResources;
     CloseScreenProcPtr CloseScreen;
@@ -521,6 +534,32 @@ NestedPreInit(ScrnInfoPtr pScrn, int flags)
                    pNested->wmName);
     }
 
+    pNested->redisplayInterval = 1000 / NESTED_DEFAULT_FPS;
+    if (xf86IsOptionSet(NestedOptions, OPTION_FPS))
+    {
+        int fps = NESTED_DEFAULT_FPS;
+
+        xf86GetOptValInteger(NestedOptions, OPTION_FPS, &fps);
+        if (fps < 0) {
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "Ignoring FPS %d, using %d\n", fps, NESTED_DEFAULT_FPS);
+            fps = NESTED_DEFAULT_FPS;
+        }
+        else if (fps > 1000) {
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "FPS %d is more than the millisecond timer can pace, "
+                       "using 1000\n", fps);
+            fps = 1000;
+        }
+        pNested->redisplayInterval = fps ? 1000 / fps : 0;
+        if (fps)
+            xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                       "Updating the host at most %d times per second\n", fps);
+        else
+            xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                       "Updating the host on every damage\n");
+    }
+
     xf86ShowUnusedOptions(pScrn->scrnIndex, pScrn->options);
 
     if (!NestedClientCheckDisplay(pNested->displayName))
@@ -707,16 +746,59 @@ NestedAddMode(ScrnInfoPtr pScrn, int width, int height)
     return TRUE;
 }
 
+/* Send the damage accumulated by NestedShadowUpdate() to the host, at
+ * most once per redisplayInterval.  Without damage, no wakeup is asked
+ * for.  Returns whether anything was sent.
+ */
+static Bool
+NestedRedisplay(NestedPrivatePtr pNested, OSTimePtr wt)
+{
+    RegionPtr pRegion = &pNested->pendingDamage;
+
+    if (!RegionNotEmpty(pRegion))
+        return FALSE;
+
+    if (pNested->redisplayInterval)
+    {
+        CARD32 now = GetTimeInMillis();
+        int delay = (int) (pNested->nextRedisplay - now);
+
+        if (delay > 0)
+        {
+            AdjustWaitForDelay(wt, delay);
+            return FALSE;
+        }
+        pNested->nextRedisplay = now + pNested->redisplayInterval;
+    }
+
+    NestedClientUpdateScreen(pNested->clientData,
+                             pRegion->extents.x1, pRegion->extents.y1,
+                             pRegion->extents.x2, pRegion->extents.y2);
+    RegionEmpty(pRegion);
+    return TRUE;
+}
+
 static void
 NestedBlockHandler(pointer data, OSTimePtr wt, pointer LastSelectMask)
 {
-    NestedClientPrivatePtr pNestedClient = data;
-    NestedClientCheckEvents(pNestedClient);
+    ScrnInfoPtr pScrn = data;
+    NestedPrivatePtr pNested = PNESTED(pScrn);
+
+    /* Events read along with replies while updating the host won't
+     * make its fd readable, so pick them up before sleeping. */
+    if (NestedRedisplay(pNested, wt))
+        NestedClientCheckEvents(pNested->clientData);
 }
 
+/* Host events are only read when the host connection is readable */
 static void
 NestedWakeupHandler(pointer data, int i, pointer LastSelectMask)
 {
+    ScrnInfoPtr pScrn = data;
+    NestedPrivatePtr pNested = PNESTED(pScrn);
+
+    if (i > 0 && FD_ISSET(pNested->hostFd, (fd_set *) LastSelectMask))
+        NestedClientCheckEvents(pNested->clientData);
 }
 
 /* Called at each server generation */
@@ -791,7 +873,10 @@ NestedScreenInit(SCREEN_INIT_ARGS_DECL)
     pNested->CloseScreen = pScreen->CloseScreen;
     pScreen->CloseScreen = NestedCloseScreen;
 
-    RegisterBlockAndWakeupHandlers(NestedBlockHandler, NestedWakeupHandler, pNested->clientData);
+    RegionNull(&pNested->pendingDamage);
+    pNested->hostFd = NestedClientGetFileDescriptor(pNested->clientData);
+    AddEnabledDevice(pNested->hostFd);
+    RegisterBlockAndWakeupHandlers(NestedBlockHandler, NestedWakeupHandler, pScrn);
 
     return TRUE;
 }
@@ -818,13 +903,15 @@ NestedCreateScreenResources(ScreenPtr pScreen)
     return ret;
 }
 
+/* Clients draw straight into the host image, so there is nothing to
+ * copy here: just remember what to send on the next NestedRedisplay(). */
 static void
 NestedShadowUpdate(ScreenPtr pScreen, shadowBufPtr pBuf)
 {
-    RegionPtr pRegion = DamageRegion(pBuf->pDamage);
-    NestedClientUpdateScreen(PCLIENTDATA(xf86ScreenToScrn(pScreen)),
-                             pRegion->extents.x1, pRegion->extents.y1,
-                             pRegion->extents.x2, pRegion->extents.y2);
+    NestedPrivatePtr pNested = PNESTED(xf86ScreenToScrn(pScreen));
+
+    RegionUnion(&pNested->pendingDamage, &pNested->pendingDamage,
+                DamageRegion(pBuf->pDamage));
 }
 
 static Bool
@@ -836,7 +923,9 @@ NestedCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 
     shadowRemove(pScreen, pScreen->GetScreenPixmap(pScreen));
 
-    RemoveBlockAndWakeupHandlers(NestedBlockHandler, NestedWakeupHandler, PNESTED(pScrn)->clientData);
+    RemoveBlockAndWakeupHandlers(NestedBlockHandler, NestedWakeupHandler, pScrn);
+    RemoveEnabledDevice(PNESTED(pScrn)->hostFd);
+    RegionUninit(&PNESTED(pScrn)->pendingDamage);
     NestedClientCloseScreen(PCLIENTDATA(pScrn));
 
     pScreen->CloseScreen = PNESTED(pScrn)->CloseScreen;